@@ -11,6 +11,7 @@
 #include "message.hpp"
 #include "types.hpp"
 
+#include <algorithm> // std::min
 #include <asio.hpp>
 #include <exception>
 #include <filesystem>
@@ -51,23 +52,26 @@ try
 
     asio::io_context ctx;
 
-    auto data_in = read_file(ctx, path_in, max_size);
+    auto data_in = map_file(path_in, max_size);
     if (fs::file_size(path_in) > data_in.size()) {
         message("WARNING: stopped after reading ", data_in.size(), " bytes from input\n");
     }
 
     auto file_out = open_file(ctx, path_out, flags::write_only | flags::create | flags::truncate);
 
-    payload data_out(data_in.size() * 3);
-    do_("Converting input data", [&]{
-        size_t n = 0;
-        for (auto in = data_in.begin(), out = data_out.begin(); in != data_in.end(); ++in, ++out, ++n) {
-            *out = n >> 8; *++out = n; *++out = *in;
+    do_("Writing start sequence", [&]{ asio::write(file_out, asio::buffer(prologue, size(prologue))); });
+    do_("Writing data",           [&]{
+        // convert one block at a time straight from the mapped input
+        byte data_out[3 * 1024];
+        auto data = data_in.data();
+        for (size_t n = 0; n < data.size(); ) {
+            auto out = data_out;
+            for (auto end = std::min(n + sizeof(data_out) / 3, data.size()); n != end; ++n) {
+                *out++ = n >> 8; *out++ = n; *out++ = data[n];
+            }
+            asio::write(file_out, asio::buffer(data_out, out - data_out));
         }
     });
-
-    do_("Writing start sequence", [&]{ asio::write(file_out, asio::buffer(prologue, size(prologue))); });
-    do_("Writing data",           [&]{ asio::write(file_out, asio::buffer(data_out)); });
     do_("Writing end sequence",   [&]{ asio::write(file_out, asio::buffer(epilogue, size(epilogue))); });
 
     message("Wrote ", file_out.size(), " bytes to output\n");
@@ -44,6 +44,11 @@ The new TC protocol is used...
 //  without ID/User Blocks sector write protection
 //#define PB_UNRESTRICTED_WRITES
 
+// uncomment the following macro to create a pilot BIOS that keeps
+//  receiving while it replies and writes flash, so that raad can
+//  pipeline its packets (raad -w N > 1)
+//#define PB_PIPELINED_RX
+
 // Directives to locate the code and data correctly for the pilot BIOS.
 #rcodorg rootcode2 0x00 0x6000 0x1800 apply
 #rvarorg rootdata2 0x00 0x7FFF 0x0800 apply
@@ -95,6 +100,11 @@ struct _dkcHeader {		//	structure for a communication header
 #define TC_DEBUG_SETDEBUGTAG				0x1a
 #define TC_DEBUG_GETDEBUGTAG           0x1b
 
+// pull in raad's extensions to the system sub-types
+#define TC_SYSTEM_ERASESECTORS			0x20
+#define TC_SYSTEM_WRITEPACKED				0x21
+#define TC_PILOT_PIPELINED					0x01	// feature flag in the ERASESECTORS probe reply
+
 // Pilot BIOS' own flash info structure
 _FlashInfoType _FlashInfo;
 
@@ -763,8 +773,15 @@ _PB_getcrc::
 
 ;//*********** Serial interrupt handler ************
 ._PB_SerialISR:
+#ifdef PB_PIPELINED_RX
+	push	af							; ISR saves its own registers, so that
+	push	bc							; it can run while the flash writer is
+	push	de							; busy (and may be using the ALT set)
+	push	hl
+#else
 	exx								; ISR has the ALT register set!
 	ex		af,af'					; it may use: a, hl, bc, de only!
+#endif
 
 #ifdef PB_TRACE_ISR
 	ld		a,0x01
@@ -809,8 +826,15 @@ _PB_getcrc::
 	ioi ld (PDDR),a				; set PD0 low
 #endif
 
+#ifdef PB_PIPELINED_RX
+	pop	hl
+	pop	de
+	pop	bc
+	pop	af
+#else
 	ex		af,af'
 	exx
+#endif
 	ipres
 	ret
 
@@ -1394,6 +1418,10 @@ _PB_Relocate::
 	jp		z,._PB_HandleERASEFLASH
 	cp		TC_SYSTEM_FLASHDATA
 	jp		z,._PB_HandleFLASHDATA
+	cp		TC_SYSTEM_ERASESECTORS
+	jp		z,._PB_HandleERASESECTORS
+	cp		TC_SYSTEM_WRITEPACKED
+	jp		z,._PB_HandleWRITEPACKED
 	; unknown subtype - NAK it!
 	jp		._PB_NakPacket
 
@@ -1510,6 +1538,7 @@ _PB_Relocate::
 	cp		b
 	jr		nz, ._PB_WRITEcopyloop
 
+._PB_WRITEcommBuffer:		; the data is in commBuffer - write it out
 	ld		hl,(ix+3)			; get the physical address of the destination
 	ex		de,hl
 	ld		hl,(ix+5)
@@ -1541,10 +1570,16 @@ _PB_Relocate::
 ; don't enable ID/User Blocks overwrite
 .noChangeXPC:
 #endif
+#ifdef PB_PIPELINED_RX
+	; leave the RX interrupt on while in the flash-writer, so that
+	; pipelined packets are not dropped
+	call	FSM_XFlash			; write it all!
+#else
 	push	ip
 	ipset	3						; turn off interupts while in the flash-writer!
 	call	FSM_XFlash			; write it all!
 	pop	ip						; restore interrupts
+#endif
 
 	ld		a, 0x72				; restore XPC value for 1st flash
 	ld		(_FlashInfo+flashXPC), a
@@ -1573,6 +1608,109 @@ _PB_Relocate::
 	ld		xpc,a
 	jp		._PB_NakPacket
 
+._PB_HandleWRITEPACKED: ; expand RLE-packed data and write it out to flash
+	; the packed data is a sequence of:
+	;   0x00-0x7f n      - followed by n+1 literal bytes
+	;   0x80-0xff n      - followed by one byte to repeat n-0x7e times
+	ld		a,xpc
+	push	af						; save the xpc
+
+	ld		a,(ix)				; get the WRITE type
+	cp		TC_SYSWRITE_PHYSICAL
+	jr		nz,._PB_WRITENak	; only PHYSICAL address are supported!
+
+	ld		a,(ix+5)				; get A[19:16]
+	and	0x0F					; mask out the unused bits
+	cp		0x08
+	jr		c,._PB_WRITENak	; ...and only flash
+
+	ld		hl,(_PB_Header+length)
+	ld		bc,-7
+	add	hl,bc
+	jr		nc,._PB_WRITENak	; no room for the WRITE header
+	ld		b,h
+	ld		c,l					; bc has the size of the packed data
+	ld		hl,_PB_Buffer+7	; hl points at the packed data
+	ld		de,commBuffer		; de points at the flash write buffer
+
+._PB_unpackLoop:
+	ld		a,b
+	or		c
+	jr		z,._PB_unpackDone
+	ld		a,(hl)				; get the control byte
+	inc	hl
+	dec	bc
+	cp		0x80
+	jr		nc,._PB_unpackRun
+
+	inc	a						; copy a+1 literal bytes...
+	call	._PB_unpackRoom
+	jp		c,._PB_WRITENak	; ...if they fit into commBuffer
+	inc	b
+	dec	b
+	jr		nz,._PB_unpackCopy
+	cp		c
+	jr		z,._PB_unpackCopy
+	jp		nc,._PB_WRITENak	; ...and are all in the packet
+._PB_unpackCopy:
+	ldi							; (de++) <- (hl++), bc--
+	dec	a
+	jr		nz,._PB_unpackCopy
+	jr		._PB_unpackLoop
+
+._PB_unpackRun:
+	sub	0x7e					; repeat the next byte a times...
+	call	._PB_unpackRoom
+	jp		c,._PB_WRITENak	; ...if they fit into commBuffer
+	inc	b
+	dec	b
+	jr		nz,._PB_unpackFillOk
+	inc	c
+	dec	c
+	jp		z,._PB_WRITENak	; ...and the byte is in the packet
+._PB_unpackFillOk:
+	push	bc
+	ld		b,a
+	ld		a,(hl)
+	inc	hl
+._PB_unpackFill:
+	ld		(de),a
+	inc	de
+	djnz	._PB_unpackFill
+	pop	bc
+	dec	bc
+	jr		._PB_unpackLoop
+
+._PB_unpackDone:
+	ex		de,hl
+	ld		de,commBuffer
+	or		a
+	sbc	hl,de
+	ex		de,hl					; de has the size of the unpacked data
+	ld		hl,(ix+1)
+	or		a
+	sbc	hl,de
+	jp		nz,._PB_WRITENak	; it should match the length of the write
+	jp		._PB_WRITEcommBuffer
+
+._PB_unpackRoom:				; set carry if a bytes don't fit into commBuffer at de
+	push	bc
+	push	hl
+	ld		b,a
+	ld		hl,commBuffer+256
+	or		a
+	sbc	hl,de					; hl has the room left in commBuffer
+	ld		a,h
+	or		a
+	jr		nz,._PB_unpackRoomOk	; all of it (carry is clear)
+	ld		a,l
+	cp		b
+._PB_unpackRoomOk:
+	ld		a,b
+	pop	hl
+	pop	bc
+	ret
+
 ._PB_HandleINFOPROBE: ; return a block of configuration data
 	ld		hl, (PB_IDBLOCK_PADDR)
    ld		(ix), hl
@@ -1702,6 +1840,63 @@ _PB_Relocate::
 	ld		(_PB_Header+length),hl		; our ACK has no data
 	jp		._PB_AckPacket					; ...and send the ACK
 
+._PB_HandleERASESECTORS: ; erase a range of sectors
+	ld		hl, (ix+4)
+	ld		a, h
+	or		l
+	jr		z, ._PB_HESProbe				; nothing to erase (raad probes for the extensions so)
+
+	ld		hl, (ix+2)						; get address of the first sector
+	ld		b, h
+	ld		c, l
+	ld		hl, (ix)
+	ex		de, hl
+	call	longToSector					; convert to sector number
+	ex		de, hl							; first sector now in DE
+	ld		hl, (ix+4)
+	ld		b, h
+	ld		c, l								; number of sectors to erase in BC
+
+#ifdef PB_UNRESTRICTED_ERASES
+	bool	hl
+	inc	hl										; ensure HL is nonzero, disable
+	ld		(_overwrite_block_flag), hl	;  ID/User Blocks protection!
+#endif
+._PB_eraseSectorLoop:
+	ld		a, b
+	or		c
+	jr		z, ._PB_HESAck					; all sectors erased?
+
+	push	bc
+	push	de
+	call	_EraseFlashSector				; erase sector in DE
+	bool	hl
+	pop	de
+	pop	bc
+	jp		nz,._PB_NakPacket				; error erasing the sector
+
+	call	_PB_hitwd						; sector erases take a while
+	inc	de
+	dec	bc
+	jr		._PB_eraseSectorLoop
+
+._PB_HESAck:
+	bool	hl
+	ld		l, h
+	ld		(_PB_Header+length),hl		; our ACK has no data
+	jp		._PB_AckPacket					; ...and send the ACK
+
+._PB_HESProbe:							; tell raad what else we can do
+#ifdef PB_PIPELINED_RX
+	ld		a, TC_PILOT_PIPELINED
+#else
+	xor	a
+#endif
+	ld		(ix), a
+	ld		hl, 1
+	ld		(_PB_Header+length),hl		; our ACK has the feature flags
+	jp		._PB_AckPacket					; ...and send the ACK
+
 ._PB_HandleFLASHDATA:
 	call	_PB_InitFlashDriver			; packet info read in _InitFlashDriver
 
@@ -1762,7 +1957,12 @@ _PB_Relocate::
 	ret
 
 ._PB_ModeTX: ; the transmit mode - send the current buffer
+#ifdef PB_PIPELINED_RX
+	; received characters are left in the RX ring until the reply is out,
+	; so that the host can pipeline its packets
+#else
 	call	._PB_Read					; this is only HALF-DUPLEX, so flush any received character
+#endif
 	call	._PB_CanTransmit
 	ret	nz							; return if the transmitter is still busy - another INT will happen later
 
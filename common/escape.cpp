@@ -0,0 +1,93 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "escape.hpp"
+#include "rabbit.hpp"
+
+#include <cstring> // std::memcpy
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#  include <emmintrin.h>
+#  define ESCAPE_SIMD
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+namespace
+{
+
+bool is_special(byte c) { return c == TC_FRAMING_START || c == TC_FRAMING_ESC; }
+
+#ifdef ESCAPE_SIMD
+// bit n is set if data[n] needs escaping
+unsigned special_mask(const byte* data)
+{
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    auto start = _mm_cmpeq_epi8(v, _mm_set1_epi8(TC_FRAMING_START));
+    auto esc = _mm_cmpeq_epi8(v, _mm_set1_epi8(TC_FRAMING_ESC));
+    return _mm_movemask_epi8(_mm_or_si128(start, esc));
+}
+#endif
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t clean_run(std::span<const byte> data)
+{
+    size_t n = 0;
+#ifdef ESCAPE_SIMD
+    for (; n + 16 <= data.size(); n += 16)
+        if (auto mask = special_mask(data.data() + n)) return n + __builtin_ctz(mask);
+#endif
+    while (n < data.size() && !is_special(data[n])) ++n;
+    return n;
+}
+
+size_t escaped_size(std::span<const byte> data)
+{
+    size_t size = data.size(), n = 0;
+#ifdef ESCAPE_SIMD
+    for (; n + 16 <= data.size(); n += 16) size += __builtin_popcount(special_mask(data.data() + n));
+#endif
+    for (; n < data.size(); ++n) size += is_special(data[n]);
+    return size;
+}
+
+byte* escape(std::span<const byte> data, byte* out)
+{
+    for (;;)
+    {
+        auto n = clean_run(data);
+        if (n) std::memcpy(out, data.data(), n);
+        out += n;
+
+        if (n == data.size()) return out;
+
+        *out++ = TC_FRAMING_ESC;
+        *out++ = data[n] & ~0x20;
+        data = data.subspan(n + 1);
+    }
+}
+
+std::pair<size_t, byte*> unescape(std::span<const byte> data, byte* out, bool& esc)
+{
+    size_t pos = 0;
+    for (;;)
+    {
+        if (pos == data.size() || data[pos] == TC_FRAMING_START) return { pos, out };
+        if (esc)
+        {
+            *out++ = data[pos++] | 0x20;
+            esc = false;
+        }
+
+        auto n = clean_run(data.subspan(pos));
+        if (n) std::memcpy(out, data.data() + pos, n);
+        out += n; pos += n;
+
+        if (pos < data.size() && data[pos] == TC_FRAMING_ESC) { esc = true; ++pos; }
+    }
+}
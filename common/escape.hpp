@@ -0,0 +1,34 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#ifndef ESCAPE_HPP
+#define ESCAPE_HPP
+
+#include "types.hpp"
+#include <span>
+#include <utility> // std::pair
+
+////////////////////////////////////////////////////////////////////////////////
+// bulk 0x7e/0x7d escaping of packet data (7d -> 7d 5d, 7e -> 7d 5e)
+
+// length of the leading run of data that needs no escaping
+size_t clean_run(std::span<const byte> data);
+
+// size of data once escaped
+size_t escaped_size(std::span<const byte> data);
+
+// escape data into out, which must hold escaped_size(data) bytes;
+// returns the end of the escaped data
+byte* escape(std::span<const byte> data, byte* out);
+
+// unescape data into out, which must hold data.size() bytes, stopping
+// at a start byte; esc carries a dangling 0x7d over to the next call;
+// returns the number of bytes used and the end of the unescaped data
+std::pair<size_t, byte*> unescape(std::span<const byte> data, byte* out, bool& esc);
+
+////////////////////////////////////////////////////////////////////////////////
+#endif
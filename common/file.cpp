@@ -11,7 +11,9 @@
 
 #include <cerrno>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 void stream_file::open(const std::string& path, flags flags)
@@ -33,6 +35,48 @@ size_t stream_file::size() const
     return st.st_size;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void mapped_file::open(const std::string& path, size_t max_size)
+{
+    close();
+
+    int desc = ::open(path.data(), O_RDONLY);
+    if (desc < 0) asio::detail::throw_error(
+        asio::error_code{errno, std::system_category()}, "mapped_file::open"
+    );
+
+    struct stat st;
+    int ret = fstat(desc, &st);
+
+    size_t size = st.st_size;
+    if (max_size && max_size < size) size = max_size;
+
+    // NB: can't map 0 bytes
+    void* addr = nullptr;
+    if (ret == 0 && size)
+    {
+        addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, desc, 0);
+        if (addr == MAP_FAILED) ret = -1;
+    }
+
+    int error = errno;
+    ::close(desc);
+
+    if (ret == -1) asio::detail::throw_error(
+        asio::error_code{error, std::system_category()}, "mapped_file::open"
+    );
+
+    addr_ = addr;
+    size_ = size;
+}
+
+void mapped_file::close()
+{
+    if (addr_) munmap(addr_, size_);
+    addr_ = nullptr;
+    size_ = 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 stream_file open_file(asio::io_context& ctx, const std::string& path, flags flags)
 {
@@ -57,4 +101,14 @@ payload read_file(asio::io_context& ctx, const std::string& path, size_t max_siz
     return data;
 }
 
+mapped_file map_file(const std::string& path, size_t max_size)
+{
+    mapped_file file;
+    do_("Mapping file ", path, [&]{
+        file.open(path, max_size);
+        doing(to_human(file.size()));
+    });
+    return file;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
@@ -10,6 +10,7 @@
 
 #include "types.hpp"
 #include <asio.hpp>
+#include <span>
 
 enum class flags
 {
@@ -33,5 +34,30 @@ struct stream_file : asio::posix::stream_descriptor
 stream_file open_file(asio::io_context&, const std::string& path, flags);
 payload read_file(asio::io_context&, const std::string& path, size_t max_size = 0);
 
+// read-only memory-mapped view of a file
+class mapped_file
+{
+public:
+    mapped_file() = default;
+    ~mapped_file() { close(); }
+
+    mapped_file(mapped_file&& rhs) noexcept { swap(rhs); }
+    mapped_file& operator=(mapped_file&& rhs) noexcept { mapped_file{std::move(rhs)}.swap(*this); return *this; }
+
+    void open(const std::string& path, size_t max_size = 0);
+    void close();
+
+    auto data() const { return std::span<const byte>{ static_cast<const byte*>(addr_), size_ }; }
+    auto size() const { return size_; }
+
+    void swap(mapped_file& rhs) noexcept { std::swap(addr_, rhs.addr_); std::swap(size_, rhs.size_); }
+
+private:
+    void* addr_ = nullptr;
+    size_t size_ = 0;
+};
+
+mapped_file map_file(const std::string& path, size_t max_size = 0);
+
 ////////////////////////////////////////////////////////////////////////////////
 #endif
@@ -0,0 +1,158 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "types.hpp"
+#include <algorithm> // std::min
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#  include <immintrin.h>
+#  define FLETCHER_SIMD
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+namespace
+{
+
+using sum = std::uint64_t;
+
+// sums of a block of n bytes: s1 = d[0] + ... + d[n-1],
+// s2 = n * d[0] + (n-1) * d[1] + ... + 1 * d[n-1]
+struct sums { sum s1 = 0, s2 = 0; };
+
+// keeps the lane sums below well within 32 bits
+constexpr size_t block_size = 4096;
+
+// shorter data is not worth blocking
+constexpr size_t min_blocked = 64;
+
+sums block_scalar(const byte* data, size_t size)
+{
+    sums s;
+    for (auto end = data + size; data != end; ++data) s.s2 += (s.s1 += *data);
+    return s;
+}
+
+#ifdef FLETCHER_SIMD
+sum hsum64(__m128i v) { return _mm_cvtsi128_si64(v) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)); }
+
+sum hsum32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<dword>(_mm_cvtsi128_si32(v));
+}
+
+// per 16 bytes: s1 += byte sum, s2 += 16 * previous s1 + weighted byte sum
+sums block_sse2(const byte* data, size_t size)
+{
+    auto zero = _mm_setzero_si128();
+    auto w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    auto w_hi = _mm_setr_epi16( 8,  7,  6,  5,  4,  3,  2, 1);
+
+    auto s1 = zero, ps = zero, s2 = zero;
+    for (auto end = data + size; data != end; data += 16)
+    {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        ps = _mm_add_epi64(ps, s1);
+        s1 = _mm_add_epi64(s1, _mm_sad_epu8(v, zero));
+        s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+        s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+    }
+    return { hsum64(s1), 16 * hsum64(ps) + hsum32(s2) };
+}
+
+// same as above, 32 bytes at a time
+__attribute__((target("avx2")))
+sums block_avx2(const byte* data, size_t size)
+{
+    auto zero = _mm256_setzero_si256();
+    auto ones = _mm256_set1_epi16(1);
+    auto w = _mm256_setr_epi8(
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1
+    );
+
+    auto s1 = zero, ps = zero, s2 = zero;
+    for (auto end = data + size; data != end; data += 32)
+    {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        ps = _mm256_add_epi64(ps, s1);
+        s1 = _mm256_add_epi64(s1, _mm256_sad_epu8(v, zero));
+        s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, w), ones));
+    }
+
+    // fold upper halves into lower ones
+    auto s1_ = _mm_add_epi64(_mm256_castsi256_si128(s1), _mm256_extracti128_si256(s1, 1));
+    auto ps_ = _mm_add_epi64(_mm256_castsi256_si128(ps), _mm256_extracti128_si256(ps, 1));
+    auto s2_ = _mm_add_epi32(_mm256_castsi256_si128(s2), _mm256_extracti128_si256(s2, 1));
+    return { hsum64(s1_), 32 * hsum64(ps_) + hsum32(s2_) };
+}
+#endif
+
+struct kernel
+{
+    sums (*fn)(const byte*, size_t);
+    size_t step;
+};
+
+kernel pick_kernel()
+{
+#ifdef FLETCHER_SIMD
+    if (__builtin_cpu_supports("avx2")) return { block_avx2, 32 };
+    return { block_sse2, 16 };
+#else
+    return { block_scalar, 1 };
+#endif
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// https://datatracker.ietf.org/doc/html/rfc1145
+word fletcher8(word init, const byte* data, size_t size)
+{
+    // NB: Rabbit ordering
+    word a = init >> 8, b = init & 0xff;
+    if (size < min_blocked)
+    {
+        for (auto end = data + size; data != end; ++data)
+        {
+            a += *data; a = (a & 0xff) + (a >> 8);
+            b += a; b = (b & 0xff) + (b >> 8);
+        }
+        return b |= (a << 8);
+    }
+
+    // with end-around carry, a and b are their sums modulo 255 in the
+    // range 1..255, and only stay 0 while everything summed so far is 0;
+    // so, sum up whole blocks and reduce once per block
+    static const auto kernel = pick_kernel();
+
+    sum sa = a % 255, sb = b % 255;
+    bool nonzero = a;
+
+    auto add = [&](sums s, size_t n){
+        sb = (sb + n * sa + s.s2) % 255;
+        sa = (sa + s.s1) % 255;
+        nonzero |= s.s1 != 0;
+    };
+
+    while (size)
+    {
+        auto n = std::min(size, block_size);
+        auto m = n - n % kernel.step;
+
+        add(kernel.fn(data, m), m);
+        add(block_scalar(data + m, n - m), n - m);
+
+        data += n; size -= n;
+    }
+
+    a = nonzero ? (sa + 254) % 255 + 1 : 0;
+    b = nonzero || b ? (sb + 254) % 255 + 1 : 0;
+    return b |= (a << 8);
+}
@@ -0,0 +1,155 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "image.hpp"
+#include "message.hpp"
+
+#include <algorithm> // std::copy, std::upper_bound
+#include <filesystem>
+#include <stdexcept>
+
+////////////////////////////////////////////////////////////////////////////////
+image::image(mapped_file file) : file_{std::move(file)}
+{
+    if (file_.size()) segments_.push_back({ 0, file_.data() });
+}
+
+image::image(mapped_file file, std::vector<segment> segments) :
+    segments_{std::move(segments)}, file_{std::move(file)}
+{ }
+
+void image::add(dword address, std::span<const byte> data)
+{
+    if (data.empty()) return;
+    auto end = address + data.size();
+
+    // first segment that starts past address
+    auto it = std::upper_bound(segments_.begin(), segments_.end(), address,
+        [](dword address, const segment& seg){ return address < seg.address; }
+    );
+    if ((it != segments_.begin() && std::prev(it)->end() > address) ||
+        (it != segments_.end() && it->address < end)
+    ) throw std::runtime_error{"Overlapping data at address " + to_hex(address)};
+
+    // append to the previous segment if adjacent
+    if (it != segments_.begin() && std::prev(it)->end() == address) --it;
+    else it = segments_.insert(it, { address, { } });
+
+    // NB: segments backed by the mapped file get copied on first change
+    auto append = [&](segment& seg, std::span<const byte> data)
+    {
+        auto& own = data_[seg.address];
+        if (own.empty()) own.assign(seg.data.begin(), seg.data.end());
+
+        own.insert(own.end(), data.begin(), data.end());
+        seg.data = own;
+    };
+    append(*it, data);
+
+    // and swallow the next one
+    if (auto next = std::next(it); next != segments_.end() && next->address == it->end())
+    {
+        append(*it, next->data);
+        data_.erase(next->address);
+        segments_.erase(next);
+    }
+}
+
+size_t image::used() const
+{
+    size_t size = 0;
+    for (auto& seg : segments_) size += seg.data.size();
+    return size;
+}
+
+payload image::flat(byte fill) const
+{
+    payload data(size(), fill);
+    for (auto& seg : segments_) std::copy(seg.data.begin(), seg.data.end(), data.begin() + seg.address);
+    return data;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+namespace
+{
+
+int from_hex(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+}
+
+// https://en.wikipedia.org/wiki/Intel_HEX
+image parse_hex(std::string_view text)
+{
+    image image;
+    dword base = 0;
+    size_t line = 0;
+
+    for (size_t pos = 0, end; pos < text.size(); pos = end + 1)
+    {
+        end = std::min(text.find('\n', pos), text.size());
+        auto rec = text.substr(pos, end - pos);
+        ++line;
+
+        while (rec.size() && (rec.back() == '\r' || rec.back() == ' ')) rec.remove_suffix(1);
+        if (rec.empty()) continue;
+
+        auto error = [&]{ return std::runtime_error{"Invalid HEX record on line " + std::to_string(line)}; };
+        if (rec[0] != ':' || rec.size() < 11 || rec.size() % 2 == 0) throw error();
+
+        payload data;
+        for (size_t n = 1; n < rec.size(); n += 2)
+        {
+            auto hi = from_hex(rec[n]), lo = from_hex(rec[n + 1]);
+            if (hi < 0 || lo < 0) throw error();
+            data.push_back(hi << 4 | lo);
+        }
+
+        // count, address (2), type, data..., checksum
+        if (data[0] + 5u != data.size() || checksum(data.data(), data.size())) throw error();
+
+        auto address = static_cast<dword>(data[1] << 8 | data[2]);
+        auto type = data[3];
+        auto rec_data = data.data() + 4;
+
+        switch (type)
+        {
+        case 0x00: image.add(base + address, { rec_data, data[0] }); break; // data
+        case 0x01: return image; // end of file
+        case 0x02: case 0x04: // extended segment/linear address
+            if (data[0] != 2) throw error();
+            base = (rec_data[0] << 8 | rec_data[1]) << (type == 0x02 ? 4 : 16);
+            break;
+        case 0x03: case 0x05: break; // start address
+        default: throw error();
+        }
+    }
+    return image;
+}
+
+image read_image(const std::string& path)
+{
+    auto file = map_file(path);
+
+    auto ext = std::filesystem::path{path}.extension();
+    if (ext != ".hex" && ext != ".ihx") return image{std::move(file)};
+
+    image image;
+    do_("Parsing HEX", [&]{
+        auto text = file.data();
+        image = parse_hex({ reinterpret_cast<const char*>(text.data()), text.size() });
+        doing(image.segments().size(), " segments, ", to_human(image.used()));
+    });
+    return image;
+}
+
+////
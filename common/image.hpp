@@ -0,0 +1,72 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+#include "file.hpp"
+#include "types.hpp"
+
+#include <asio.hpp>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// contiguous block of program data at a given flash offset
+struct segment
+{
+    dword address;
+    std::span<const byte> data;
+
+    auto end() const { return address + data.size(); }
+};
+
+// program image made up of sorted, non-overlapping segments;
+// segment data lives in the mapped file or in the image itself
+class image
+{
+public:
+    image() = default;
+    explicit image(mapped_file);
+
+    // segments pointing into the mapped file
+    image(mapped_file, std::vector<segment>);
+
+    image(image&&) = default;
+    image& operator=(image&&) = default;
+
+    // add copy of data and merge it with its neighbours
+    void add(dword address, std::span<const byte> data);
+
+    auto const& segments() const { return segments_; }
+
+    // offset past the highest used address
+    size_t size() const { return segments_.empty() ? 0 : segments_.back().end(); }
+
+    // total number of bytes used
+    size_t used() const;
+
+    // flat copy with holes filled in
+    payload flat(byte fill = 0xff) const;
+
+private:
+    std::vector<segment> segments_;
+
+    mapped_file file_;
+    std::map<dword, payload> data_; // by segment address
+};
+
+image parse_hex(std::string_view text);
+
+// read flat binary or Intel HEX (.hex, .ihx) file
+image read_image(const std::string& path);
+
+////////////////////////////////////////////////////////////////////////////////
+#endif
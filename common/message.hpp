@@ -9,12 +9,101 @@
 #define MESSAGE_HPP
 
 #include <cstdint> // std::size_t
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
 #include <tuple>
+#include <utility> // std::exchange
 
-inline void message(auto&&... args) { (std::cout << ... << std::forward<decltype (args)>(args)) << std::flush; }
+namespace detail
+{
+
+// when the thread has a prefix, its messages are collected and written out
+// one line at a time, so that concurrent sessions don't garble each other
+inline thread_local std::ostream* out = &std::cout;
+inline thread_local std::string prefix, line;
+inline thread_local std::size_t last_pc = 0;
+inline std::mutex mutex;
+
+// when set, take the thread's lines and progress instead
+inline thread_local std::function<void(const std::string&)> on_line;
+inline thread_local std::function<void(std::size_t)> on_progress;
+
+inline void put_line(const std::string& line)
+{
+    if (on_line) return on_line(prefix + line.substr(0, line.find('\n')));
+
+    std::scoped_lock lock{mutex};
+    *out << prefix << line << std::flush;
+}
+
+}
+
+// set message stream and prefix for the calling thread
+inline void message_stream(std::ostream& os) { detail::out = &os; }
+inline void message_prefix(std::string prefix) { detail::prefix = std::move(prefix); }
+
+// pass the calling thread's messages to on_line one line at a time (without
+// the newline) and its progress to on_progress, while in scope
+struct message_handler
+{
+    message_handler(std::function<void(const std::string&)> on_line, std::function<void(std::size_t)> on_progress) :
+        on_line_{std::exchange(detail::on_line, std::move(on_line))},
+        on_progress_{std::exchange(detail::on_progress, std::move(on_progress))},
+        line_{std::exchange(detail::line, { })}
+    { }
+    ~message_handler()
+    {
+        detail::on_line = std::move(on_line_);
+        detail::on_progress = std::move(on_progress_);
+        detail::line = std::move(line_);
+    }
+
+    message_handler(const message_handler&) = delete;
+    message_handler& operator=(const message_handler&) = delete;
+
+private:
+    std::function<void(const std::string&)> on_line_;
+    std::function<void(std::size_t)> on_progress_;
+    std::string line_;
+};
+
+inline void message(auto&&... args)
+{
+    if (detail::prefix.empty() && !detail::on_line)
+    {
+        (*detail::out << ... << std::forward<decltype (args)>(args)) << std::flush;
+        return;
+    }
+
+    std::ostringstream os;
+    (os << ... << std::forward<decltype (args)>(args));
+    detail::line += os.str();
+
+    for (std::size_t pos; (pos = detail::line.find('\n')) != std::string::npos; )
+    {
+        detail::put_line(detail::line.substr(0, pos + 1));
+        detail::line.erase(0, pos + 1);
+    }
+}
 inline void doing(auto&&... args) { message(std::forward<decltype (args)>(args)..., "... "); }
 
+inline void progress(std::size_t pc)
+{
+    if (detail::on_progress) detail::on_progress(pc);
+
+    else if (detail::prefix.empty() && !detail::on_line)
+        message(pc, "%... ", std::string(5 + ((pc < 10) ? 1 : (pc < 100) ? 2 : 3), '\b'));
+
+    // with prefix or line handler, report every 10%
+    else if (pc / 10 != detail::last_pc / 10 && pc < 100)
+        detail::put_line(detail::line + std::to_string(pc) + "%\n");
+
+    detail::last_pc = pc;
+}
+
 inline void done() { message("OK\n"); }
 inline void fail() { message("FAILED\n"); }
 
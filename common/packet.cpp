@@ -0,0 +1,123 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "escape.hpp"
+#include "packet.hpp"
+
+#include <algorithm> // std::min
+#include <cstring> // std::memchr
+#include <stdexcept>
+
+////////////////////////////////////////////////////////////////////////////////
+std::span<const byte> encode_packet(std::span<byte> buffer, byte subtype, std::initializer_list<std::span<const byte>> data, byte tag)
+{
+    size_t data_size = 0;
+    for (auto& part : data) data_size += part.size();
+    if (data_size > max_data_size) throw std::runtime_error{"Packet too large"};
+
+    packet_head head;
+    head.version    = TC_VERSION;
+    head.flags      = tag; // echoed back by the pilot
+    head.type       = TC_TYPE_SYSTEM;
+    head.subtype    = subtype;
+    head.data_size  = data_size;
+    head.check      = fletcher8(addressof(head), sizeof(head) - sizeof(head.check));
+
+    auto check = fletcher8(addressof(head), sizeof(head));
+    for (auto& part : data) check = fletcher8(check, part.data(), part.size());
+
+    std::span<const byte> head_bytes{ addressof(head), sizeof(head) }, check_bytes{ addressof(check), sizeof(check) };
+
+    auto size = 1 + escaped_size(head_bytes) + escaped_size(check_bytes);
+    for (auto& part : data) size += escaped_size(part);
+    if (buffer.size() < size) throw std::runtime_error{"Packet too large"};
+
+    auto out = buffer.data();
+    *out++ = TC_FRAMING_START;
+    out = escape(head_bytes, out);
+    for (auto& part : data) out = escape(part, out);
+    out = escape(check_bytes, out);
+
+    return buffer.first(out - buffer.data());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool packet_decoder::put(byte c)
+{
+    if (c == TC_FRAMING_START)
+    {
+        state_ = in_head; esc_ = false;
+        ptr_ = addressof(head_); end_ = ptr_ + sizeof(head_);
+        return false;
+    }
+    else if (state_ == idle) return false;
+    else if (c == TC_FRAMING_ESC) { esc_ = true; return false; }
+    else if (esc_) { c |= 0x20; esc_ = false; }
+
+    *ptr_++ = c;
+    return ptr_ == end_ && next();
+}
+
+std::pair<size_t, bool> packet_decoder::put(std::span<const byte> data)
+{
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+        if (state_ == idle)
+        {
+            // skip to the next start byte
+            auto p = std::memchr(data.data() + pos, TC_FRAMING_START, data.size() - pos);
+            if (!p) return { data.size(), false };
+            pos = static_cast<const byte*>(p) - data.data();
+        }
+        else
+        {
+            // unescape straight into the current field; it takes at least
+            // as many bytes as it gets, so never more than the field holds
+            auto [n, end] = unescape(data.subspan(pos, std::min<size_t>(data.size() - pos, end_ - ptr_)), ptr_, esc_);
+            if (n)
+            {
+                ptr_ = end; pos += n;
+
+                if (ptr_ == end_ && next()) return { pos, true };
+                continue;
+            }
+        }
+        if (put(data[pos++])) return { pos, true };
+    }
+    return { pos, false };
+}
+
+bool packet_decoder::next()
+{
+    switch (state_)
+    {
+    case in_head:
+        if (head_.check != fletcher8(addressof(head_), sizeof(head_) - sizeof(head_.check)) || head_.data_size > max_data_size)
+        {
+            state_ = idle; // drop the packet
+            return false;
+        }
+
+        state_ = in_body;
+        ptr_ = data_; end_ = ptr_ + head_.data_size;
+        if (ptr_ != end_) return false;
+        [[fallthrough]];
+
+    case in_body:
+        state_ = in_foot;
+        ptr_ = addressof(check_); end_ = ptr_ + sizeof(check_);
+        return false;
+
+    case in_foot:
+        state_ = idle;
+        return true;
+
+    case idle: break;
+    }
+    return false;
+}
@@ -0,0 +1,68 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#ifndef PACKET_HPP
+#define PACKET_HPP
+
+#include "rabbit.hpp"
+#include "types.hpp"
+
+#include <array>
+#include <initializer_list>
+#include <span>
+#include <utility> // std::pair
+
+////////////////////////////////////////////////////////////////////////////////
+// size of the pilot's packet body buffer (_PB_Buffer)
+constexpr size_t max_data_size = 0x100;
+
+// start byte + header, data & footer with every byte escaped
+constexpr size_t max_packet_size = 1 + 2 * (sizeof(packet_head) + max_data_size + sizeof(word));
+
+using packet_buffer = std::array<byte, max_packet_size>;
+
+// frame packet with data gathered from several parts into buffer
+// and return the used part
+std::span<const byte> encode_packet(std::span<byte> buffer, byte subtype, std::initializer_list<std::span<const byte>> data, byte tag = 0);
+
+inline auto encode_packet(std::span<byte> buffer, byte subtype, std::span<const byte> data, byte tag = 0)
+{
+    return encode_packet(buffer, subtype, { data }, tag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// framing/unescaping state machine for the received packets
+struct packet_decoder
+{
+    // feed the next byte; returns true when a complete packet is received
+    bool put(byte);
+
+    // feed bytes up to the end of the next complete packet;
+    // returns the number of bytes used and whether the packet is complete
+    std::pair<size_t, bool> put(std::span<const byte>);
+
+    auto const& head() const { return head_; }
+    auto data() const { return std::span<const byte>{data_, head_.data_size}; }
+    auto check() const { return check_; }
+
+private:
+    enum { idle, in_head, in_body, in_foot } state_ = idle;
+    bool esc_ = false;
+
+    packet_head head_;
+    byte data_[max_data_size];
+    word check_;
+
+    byte* ptr_ = nullptr;
+    byte* end_ = nullptr;
+
+    // move on to the next part of the packet once the current one is filled
+    bool next();
+};
+
+////////////////////////////////////////////////////////////////////////////////
+#endif
@@ -36,15 +36,20 @@ enum : byte
     TC_SYSTEM_RELOCATE      = 0x08,
     TC_SYSTEM_ERASEFLASH    = 0x09,
     TC_SYSTEM_FLASHDATA     = 0x0a,
+    TC_SYSTEM_ERASESECTORS  = 0x20, // pilot extension
+    TC_SYSTEM_WRITEPACKED   = 0x21, // pilot extension
 
     TC_SUBTYPE_MASK         = 0x3f,
     TC_NAK                  = 0x40,
     TC_ACK                  = 0x80,
 
+    TC_SYSREAD_PHYSICAL     = 0x00,
     TC_SYSWRITE_PHYSICAL    = 0x00,
 
     TC_STARTBIOS_RAM        = 0x01,
     TC_STARTBIOS_FLASH      = 0x02,
+
+    TC_PILOT_PIPELINED      = 0x01, // pilot extension: built with PB_PIPELINED_RX
 };
 
 #pragma pack(push, 1)
@@ -69,7 +74,7 @@ struct info_probe
 {
     dword _1;
     word flash_id;
-    byte _2;
+    byte ram_size; // in 32K blocks
     byte div_19200;
     dword cpu_id;
     struct
@@ -94,8 +99,18 @@ struct flash_data
     param;
 };
 
+// physical address of the flash
+constexpr dword flash_address = 0x80000;
+
+// physical RAM occupied by the pilot
+constexpr dword pilot_start = 0x4000;
+constexpr dword pilot_end = 0x6000;
+
 constexpr size_t write_size = 0x80;
 
+// usable size of the pilot's RX ring (_PB_RXBuffer)
+constexpr size_t pilot_rx_size = 0xff;
+
 struct write_data
 {
     byte type;
@@ -103,6 +118,28 @@ struct write_data
     dword address;
     byte data[write_size];
 };
+
+struct erase_data
+{
+    dword address;
+    word num_sec;
+};
+
+constexpr size_t read_size = 0x80;
+
+struct read_data
+{
+    byte type;
+    word data_size;
+    dword address;
+};
+
+struct read_reply
+{
+    word data_size;
+    dword address;
+    byte data[read_size];
+};
 #pragma pack(pop)
 
 const std::map<word, const char*> cpu_info
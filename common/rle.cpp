@@ -0,0 +1,53 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "rle.hpp"
+#include <algorithm> // std::copy
+
+////////////////////////////////////////////////////////////////////////////////
+namespace
+{
+
+constexpr size_t max_literal = 0x80;
+constexpr size_t max_run = 0x81;
+
+// does a run of at least 3 bytes start at pos?
+bool is_run(std::span<const byte> data, size_t pos)
+{
+    return pos + 2 < data.size() && data[pos] == data[pos + 1] && data[pos] == data[pos + 2];
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+size_t rle_pack(std::span<const byte> data, std::span<byte> buffer)
+{
+    size_t out = 0;
+    for (size_t pos = 0; pos < data.size(); )
+    {
+        size_t n = 1;
+        if (is_run(data, pos))
+        {
+            while (pos + n < data.size() && n < max_run && data[pos + n] == data[pos]) ++n;
+            if (out + 2 > buffer.size()) return 0;
+
+            buffer[out++] = 0x7e + n;
+            buffer[out++] = data[pos];
+        }
+        else
+        {
+            // literals up to the next run
+            while (pos + n < data.size() && n < max_literal && !is_run(data, pos + n)) ++n;
+            if (out + 1 + n > buffer.size()) return 0;
+
+            buffer[out++] = n - 1;
+            out = std::copy(data.begin() + pos, data.begin() + pos + n, buffer.begin() + out) - buffer.begin();
+        }
+        pos += n;
+    }
+    return out;
+}
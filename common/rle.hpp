@@ -0,0 +1,25 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#ifndef RLE_HPP
+#define RLE_HPP
+
+#include "types.hpp"
+#include <span>
+
+////////////////////////////////////////////////////////////////////////////////
+// RLE format understood by the pilot (TC_SYSTEM_WRITEPACKED):
+//
+//   0x00-0x7f, followed by n+1 literal bytes
+//   0x80-0xff, followed by one byte to repeat n-0x7e times
+//
+// pack data into buffer and return the packed size,
+// or 0 if it doesn't fit
+size_t rle_pack(std::span<const byte> data, std::span<byte> buffer);
+
+////////////////////////////////////////////////////////////////////////////////
+#endif
@@ -8,8 +8,12 @@
 #include "message.hpp"
 #include "serial.hpp"
 
+#include <algorithm> // std::max, std::min
+
 #if defined(__unix__) || defined(__APPLE__)
   #include <cerrno>
+  #include <poll.h>
+  #include <sys/ioctl.h>
   #include <termios.h>
 #else
   #error "Unsupported platform"
@@ -23,20 +27,61 @@ asio::serial_port open_serial(asio::io_context& ctx, const std::string& name)
     return port;
 }
 
+void reopen_serial(asio::serial_port& port, const std::string& name, std::chrono::milliseconds timeout)
+{
+    do_("Reopening serial port ", name, [&]{
+        asio::error_code ec;
+        port.close(ec);
+
+        for (auto deadline = std::chrono::steady_clock::now() + timeout;; sleep_for(250ms))
+        {
+            port.open(name, ec);
+            if (!ec) break;
+
+            if (std::chrono::steady_clock::now() >= deadline) asio::detail::throw_error(ec, "reopen_serial");
+        }
+    });
+}
+
 ////////////////////////////////////////////////////////////////////////////////
-void send_data(asio::serial_port& port, const payload& data, size_t max_size)
+namespace
+{
+
+auto time_left(std::chrono::steady_clock::time_point deadline)
+{
+    auto left = deadline - std::chrono::steady_clock::now();
+    return std::max(std::chrono::duration_cast<std::chrono::milliseconds>(left), 0ms);
+}
+
+}
+
+bool send_data(asio::serial_port& port, const payload& data, std::chrono::milliseconds timeout, size_t max_size)
 {
     if (max_size == 0) max_size = data.size();
     else if (max_size > data.size()) max_size = data.size();
 
-    asio::write(port, asio::buffer(data), [&](const asio::error_code& ec, size_t n){
-        auto pc = n * 100 / max_size;
-        message(pc, "%... ", std::string(5 + ((pc < 10) ? 1 : (pc < 100) ? 2 : 3), '\b'));
-        return max_size - n;
-    });
+    // in small pieces for progress
+    constexpr size_t piece = 64;
 
-    drain(port);
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (size_t n = 0; n < max_size; n += piece)
+    {
+        progress(n * 100 / max_size);
+        if (!write_for(port, { data.data() + n, std::min(piece, max_size - n) }, time_left(deadline))) return false;
+    }
+
+    if (!drain_for(port, time_left(deadline))) return false;
     message("100%... ");
+    return true;
+}
+
+std::chrono::milliseconds line_time(asio::serial_port& port, size_t size)
+{
+    asio::serial_port::baud_rate rate;
+    port.get_option(rate);
+
+    // start + 8 data + stop bits, rounded up
+    return std::chrono::milliseconds{(size * 10 * 1000 + rate.value() - 1) / rate.value()};
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -119,6 +164,114 @@ void drain(asio::serial_port& port, asio::error_code& ec)
     if (tcdrain(fd)) ec.assign(errno, asio::system_category());
 }
 
+////////////////////////////////////////////////////////////////////////////////
+bool wait_rx(asio::serial_port& port, std::chrono::milliseconds timeout)
+{
+    asio::error_code ec;
+    auto s = wait_rx(port, timeout, ec);
+    asio::detail::throw_error(ec, "wait_rx");
+    return s;
+}
+
+bool wait_rx(asio::serial_port& port, std::chrono::milliseconds timeout, asio::error_code& ec)
+{
+    pollfd fd{ port.native_handle(), POLLIN, 0 };
+
+    int n;
+    do n = poll(&fd, 1, timeout.count());
+    while (n < 0 && errno == EINTR);
+
+    if (n < 0) ec.assign(errno, asio::system_category());
+    return n > 0;
+}
+
+bool drain_for(asio::serial_port& port, std::chrono::milliseconds timeout)
+{
+    asio::error_code ec;
+    auto s = drain_for(port, timeout, ec);
+    asio::detail::throw_error(ec, "drain_for");
+    return s;
+}
+
+bool drain_for(asio::serial_port& port, std::chrono::milliseconds timeout, asio::error_code& ec)
+{
+    int fd = port.native_handle();
+    for (auto deadline = std::chrono::steady_clock::now() + timeout;;)
+    {
+        int n;
+        if (ioctl(fd, TIOCOUTQ, &n)) { ec.assign(errno, asio::system_category()); return false; }
+        if (n == 0) return true;
+
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            flush(port, que_out, ec);
+            return false;
+        }
+
+        // come back when the queued bytes should be out
+        sleep_for(std::min(line_time(port, n), time_left(deadline)));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool read_for(asio::serial_port& port, std::span<byte> data, std::chrono::milliseconds timeout)
+{
+    asio::error_code ec;
+    auto s = read_for(port, data, timeout, ec);
+    asio::detail::throw_error(ec, "read_for");
+    return s;
+}
+
+bool read_for(asio::serial_port& port, std::span<byte> data, std::chrono::milliseconds timeout, asio::error_code& ec)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (data.size())
+    {
+        if (!wait_rx(port, time_left(deadline), ec)) return false;
+
+        auto n = port.read_some(asio::buffer(data.data(), data.size()), ec);
+        if (ec) return false;
+
+        data = data.subspan(n);
+    }
+    return true;
+}
+
+bool write_for(asio::serial_port& port, std::span<const byte> data, std::chrono::milliseconds timeout)
+{
+    asio::error_code ec;
+    auto s = write_for(port, data, timeout, ec);
+    asio::detail::throw_error(ec, "write_for");
+    return s;
+}
+
+bool write_for(asio::serial_port& port, std::span<const byte> data, std::chrono::milliseconds timeout, asio::error_code& ec)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (data.size())
+    {
+        pollfd fd{ port.native_handle(), POLLOUT, 0 };
+
+        int n;
+        do n = poll(&fd, 1, time_left(deadline).count());
+        while (n < 0 && errno == EINTR);
+
+        if (n < 0) { ec.assign(errno, asio::system_category()); return false; }
+        if (n == 0)
+        {
+            // don't leave a partial write on the line
+            flush(port, que_out, ec);
+            return false;
+        }
+
+        auto size = port.write_some(asio::buffer(data.data(), data.size()), ec);
+        if (ec) return false;
+
+        data = data.subspan(size);
+    }
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 void flush(asio::serial_port& port, que que)
 {
@@ -133,3 +286,10 @@ void flush(asio::serial_port& port, que que, asio::error_code& ec)
     int qs = (que == que_in) ? TCIFLUSH : (que == que_out) ? TCOFLUSH : (que == que_both) ? TCIOFLUSH : -1;
     if (tcflush(fd, qs)) ec.assign(errno, asio::system_category());
 }
+
+////////////////////////////////////////////////////////////////////////////////
+void rx_buffer::fill()
+{
+    head_ = 0;
+    tail_ = port_.read_some(asio::buffer(data_));
+}
@@ -11,11 +11,22 @@
 #include "types.hpp"
 
 #include <asio.hpp>
+#include <chrono>
+#include <span>
 #include <string>
 
 ////////////////////////////////////////////////////////////////////////////////
 asio::serial_port open_serial(asio::io_context&, const std::string& name);
-void send_data(asio::serial_port&, const payload&, size_t max_size = 0);
+
+// reopen port (eg, unplugged USB adapter), waiting up to timeout for it to come back
+void reopen_serial(asio::serial_port&, const std::string& name, std::chrono::milliseconds timeout);
+
+// send up to max_size bytes of data (all, if 0) with progress and wait for them to leave;
+// returns false if that takes longer than timeout
+bool send_data(asio::serial_port&, const payload&, std::chrono::milliseconds timeout, size_t max_size = 0);
+
+// how long size bytes take on the line at the current baud rate
+std::chrono::milliseconds line_time(asio::serial_port&, size_t size);
 
 void baud_rate(asio::serial_port&, unsigned);
 void baud_rate(asio::serial_port&, unsigned, asio::error_code&);
@@ -41,9 +52,58 @@ void dtr(asio::serial_port&, bool, asio::error_code&);
 void drain(asio::serial_port&);
 void drain(asio::serial_port&, asio::error_code&);
 
+// bounded versions of drain and asio::read/write; return false on timeout,
+// and drop whatever output is left unsent
+bool drain_for(asio::serial_port&, std::chrono::milliseconds);
+bool drain_for(asio::serial_port&, std::chrono::milliseconds, asio::error_code&);
+
+bool read_for(asio::serial_port&, std::span<byte>, std::chrono::milliseconds);
+bool read_for(asio::serial_port&, std::span<byte>, std::chrono::milliseconds, asio::error_code&);
+
+bool write_for(asio::serial_port&, std::span<const byte>, std::chrono::milliseconds);
+bool write_for(asio::serial_port&, std::span<const byte>, std::chrono::milliseconds, asio::error_code&);
+
+// wait for data to arrive; returns false on timeout
+bool wait_rx(asio::serial_port&, std::chrono::milliseconds);
+bool wait_rx(asio::serial_port&, std::chrono::milliseconds, asio::error_code&);
+
 enum que { que_in, que_out, que_both };
 void flush(asio::serial_port&, que);
 void flush(asio::serial_port&, que, asio::error_code&);
 
+////////////////////////////////////////////////////////////////////////////////
+// buffered receiver: pulls whatever the port has in one read
+// and keeps the leftover bytes for the next call
+struct rx_buffer
+{
+    explicit rx_buffer(asio::serial_port& port) : port_{port} { }
+
+    byte get()
+    {
+        if (head_ == tail_) fill();
+        return data_[head_++];
+    }
+
+    // bytes received so far (reading more if there are none);
+    // skip() the ones used
+    std::span<const byte> peek()
+    {
+        if (head_ == tail_) fill();
+        return { data_ + head_, tail_ - head_ };
+    }
+    void skip(size_t n) { head_ += n; }
+
+    // wait for data to arrive; returns false on timeout
+    bool wait(std::chrono::milliseconds timeout) { return head_ != tail_ || wait_rx(port_, timeout); }
+
+private:
+    asio::serial_port& port_;
+
+    byte data_[1024];
+    size_t head_ = 0, tail_ = 0;
+
+    void fill();
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 #endif
@@ -44,16 +44,3 @@ byte checksum(const byte* data, size_t size)
     for (auto end = data + size; data != end; ++data) check += *data;
     return check;
 }
-
-// https://datatracker.ietf.org/doc/html/rfc1145
-word fletcher8(word init, const byte* data, size_t size)
-{
-    // NB: Rabbit ordering
-    word a = init >> 8, b = init & 0xff;
-    for (auto end = data + size; data != end; ++data)
-    {
-        a += *data; a = (a & 0xff) + (a >> 8);
-        b += a; b = (b & 0xff) + (b >> 8);
-    }
-    return b |= (a << 8);
-}
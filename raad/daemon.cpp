@@ -0,0 +1,204 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "daemon.hpp"
+#include "file.hpp"
+#include "link.hpp"
+#include "message.hpp"
+#include "pack.hpp"
+#include "serial.hpp"
+
+#include <cstdlib> // std::getenv
+#include <filesystem>
+#include <future>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h> // getuid
+
+using asio::local::stream_protocol;
+
+////////////////////////////////////////////////////////////////////////////////
+namespace
+{
+
+// board on one of the ports owned by the daemon
+struct board
+{
+    board(asio::io_context& ctx, const std::string& name) : port{open_serial(ctx, name)} { }
+
+    asio::serial_port port;
+    link_profile link;
+    bool warm = false; // pilot is (most likely) running
+    std::mutex mutex;
+};
+
+struct server
+{
+    asio::io_context& ctx;
+    const payload& coldload;
+    const payload& pilot;
+    const ::params& params;
+
+    std::map<std::string, std::unique_ptr<board>> boards;
+};
+
+void run_job(server& server, const std::string& job)
+{
+    std::istringstream is{job};
+
+    std::string cmd, name;
+    is >> cmd >> std::quoted(name);
+
+    auto it = server.boards.find(name);
+    if (it == server.boards.end()) throw std::runtime_error{"Unknown port " + name};
+
+    // check the whole job before resetting the board
+    auto params = server.params;
+    pack program;
+    stream_file file{server.ctx};
+    size_t size = 0;
+
+    if (cmd == "flash" || cmd == "verify")
+    {
+        std::string path;
+        if (!(is >> std::quoted(path))) throw std::runtime_error{"Invalid " + cmd + " job"};
+
+        for (std::string opt; cmd == "flash" && is >> opt; )
+        {
+            if (opt == "compress") params.compress = true;
+            else if (opt == "diff") params.diff = true;
+            else if (opt == "verify") params.verify = true;
+            else if (opt == "run") params.run = true;
+            else if (opt == "ram") params.run_in_ram = true;
+            else throw std::runtime_error{"Invalid option " + opt};
+        }
+        program = load_program(path);
+    }
+    else if (cmd == "read")
+    {
+        std::string path;
+        if (!(is >> std::quoted(path) >> size) || !size) throw std::runtime_error{"Invalid read job"};
+
+        file.open(path, flags::write_only | flags::create | flags::truncate);
+    }
+    else if (cmd != "run") throw std::runtime_error{"Invalid job " + cmd};
+
+    if (std::string extra; is >> extra) throw std::runtime_error{"Invalid option " + extra};
+
+    auto& board = *it->second;
+    std::scoped_lock lock{board.mutex};
+
+    // bootstrap the board unless its pilot is still there
+    bool warm = board.warm && find_pilot(board.port, params, board.link.baud_rate);
+    if (!warm) bootstrap(board.port, server.coldload, server.pilot, params);
+
+    board.warm = false;
+    if (cmd == "flash")
+        send_program(board.port, name, program, params, board.link, warm);
+
+    else if (cmd == "verify")
+        verify_program(board.port, program.image, params, board.link, warm);
+
+    else if (cmd == "read")
+    {
+        auto data = read_program(board.port, size, params, board.link, warm);
+        do_("Writing data", [&]{ asio::write(file, asio::buffer(data)); });
+    }
+    else run_program(board.port, params, board.link, warm);
+
+    board.warm = board.link.pilot;
+}
+
+void serve(server& server, stream_protocol::socket socket)
+{
+    stream_protocol::iostream stream{std::move(socket)};
+
+    std::string job;
+    if (!std::getline(stream, job)) return;
+
+    message("Job: ", job, '\n');
+
+    message_stream(stream);
+    try
+    {
+        run_job(server, job);
+        stream << "done" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        stream << "error: " << e.what() << std::endl;
+    }
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::string default_socket()
+{
+    if (auto dir = std::getenv("XDG_RUNTIME_DIR"); dir && *dir)
+        return std::filesystem::path{dir} / "raad.sock";
+    else return "/tmp/raad-" + std::to_string(getuid()) + ".sock";
+}
+
+void run_daemon(asio::io_context& ctx, const std::string& socket, const std::vector<std::string>& ports,
+    const payload& coldload, const payload& pilot, const params& params)
+{
+    server server{ctx, coldload, pilot, params, { }};
+    for (auto& name : ports) server.boards.emplace(name, std::make_unique<board>(ctx, name));
+
+    // remove stale socket left by a previous instance,
+    // but not one another daemon is still listening on
+    if (std::error_code ec; std::filesystem::is_socket(socket, ec))
+    {
+        stream_protocol::socket peer{ctx};
+        asio::error_code error;
+        peer.connect(stream_protocol::endpoint{socket}, error);
+        if (!error) throw std::runtime_error{"Daemon already listening on " + socket};
+
+        std::filesystem::remove(socket, ec);
+    }
+
+    stream_protocol::acceptor acceptor{ctx};
+    do_("Listening on ", socket, [&]{ acceptor = stream_protocol::acceptor{ctx, stream_protocol::endpoint{socket}}; });
+
+    // one thread per client; jobs for different boards run concurrently;
+    // the futures join them on the way out, so server outlives every job
+    std::vector<std::future<void>> clients;
+    for (;;)
+    {
+        auto peer = acceptor.accept();
+        std::erase_if(clients, [](auto& client){ return client.wait_for(0s) == std::future_status::ready; });
+        clients.push_back(std::async(std::launch::async, [&, peer = std::move(peer)]() mutable { serve(server, std::move(peer)); }));
+    }
+}
+
+bool send_job(const std::string& socket, const std::string& job)
+{
+    stream_protocol::iostream stream{stream_protocol::endpoint{socket}};
+    if (!stream) throw std::runtime_error{"Can't connect to " + socket + ": " + stream.error().message()};
+
+    stream << job << std::endl;
+
+    // relay messages; the last line is the result
+    std::string text, line, last;
+    for (char c; stream.get(c); )
+    {
+        text += c;
+        if (c == '\n') last = std::move(line), line.clear();
+        else line += c;
+
+        // pass on partial lines too, eg progress
+        if (stream.rdbuf()->in_avail() == 0) message(text), text.clear();
+    }
+    message(text);
+
+    return last == "done";
+}
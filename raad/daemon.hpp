@@ -0,0 +1,40 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#ifndef DAEMON_HPP
+#define DAEMON_HPP
+
+#include "raad.hpp"
+#include "types.hpp"
+
+#include <asio.hpp>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// Jobs are sent to the daemon one per connection, as a single line:
+//
+//   flash  "port" "program.bin" [compress] [diff] [verify] [run] [ram]
+//   verify "port" "program.bin"
+//   read   "port" "output.bin" size
+//   run    "port"
+//
+// The job is checked before the board is touched. The daemon sends back
+// the job's messages, followed by "done" or "error: <reason>" on the last line.
+
+// $XDG_RUNTIME_DIR/raad.sock or /tmp/raad-<uid>.sock
+std::string default_socket();
+
+// serve jobs for the boards on the ports; keeps their pilots running between jobs
+void run_daemon(asio::io_context&, const std::string& socket, const std::vector<std::string>& ports,
+    const payload& coldload, const payload& pilot, const params&);
+
+// send job to the daemon and relay its messages; returns true if the job succeeded
+bool send_job(const std::string& socket, const std::string& job);
+
+////////////////////////////////////////////////////////////////////////////////
+#endif
@@ -0,0 +1,320 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "file.hpp"
+#include "librabbit.h"
+#include "librabbit.hpp"
+#include "link.hpp"
+#include "message.hpp"
+#include "pack.hpp"
+#include "rabbit.hpp"
+#include "raad.hpp"
+#include "serial.hpp"
+
+#include <algorithm> // std::copy, std::max
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility> // std::exchange
+
+////////////////////////////////////////////////////////////////////////////////
+namespace rabbit
+{
+
+namespace
+{
+
+constexpr auto def_coldload = BIOS_DIR "/coldload.bin";
+constexpr auto def_pilot = BIOS_DIR "/pilot.bin";
+
+::params to_params(const options& options)
+{
+    ::params params;
+    params.compress = options.compress;
+    params.diff = options.diff;
+    params.verify = options.verify;
+    params.run = options.run;
+    params.run_in_ram = options.ram;
+    params.slow = options.slow;
+    params.use_cts = options.use_cts;
+    params.use_rts = options.use_rts;
+    params.window = std::max(options.window, 1u);
+    params.retries = options.retries;
+    params.boot_tries = std::max(options.boot_tries, 1u);
+    params.reply_time = msec{options.reply_ms};
+    return params;
+}
+
+}
+
+status status_of(std::exception_ptr ep)
+{
+    if (!ep) return status::ok;
+
+    try { std::rethrow_exception(ep); }
+    catch (const ::link_error&) { return status::link_error; }
+    catch (const asio::system_error&) { return status::port_error; }
+    catch (...) { return status::failed; }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+struct session::impl
+{
+    impl(const std::string& name, ::params params) : name{name}, port{ctx, name}, params{params} { }
+
+    asio::io_context ctx;
+    std::string name;
+    asio::serial_port port;
+    ::params params;
+
+    payload coldload, pilot;
+    link_profile link;
+    bool warm = false;   // pilot is (most likely) running
+    bool booted = false; // pilot has just been bootstrapped
+
+    std::function<void(const std::string&)> on_message;
+    std::function<void(unsigned)> on_progress;
+    std::mutex mutex;
+
+    // do fn one at a time, with messages going to the callbacks
+    template<typename Fn>
+    auto call(Fn fn)
+    {
+        std::scoped_lock lock{mutex};
+        message_handler handler{
+            [&](const std::string& line){ if (on_message) on_message(line); },
+            [&](std::size_t pc){ if (on_progress) on_progress(pc); }
+        };
+        return fn();
+    }
+
+    // make sure the pilot is running; returns true if it is already
+    // talking at link.baud_rate
+    bool start()
+    {
+        if (coldload.empty()) throw std::runtime_error{"Not connected"};
+        if (std::exchange(booted, false)) return false;
+
+        if (std::exchange(warm, false) && find_pilot(port, params, link.baud_rate)) return true;
+
+        bootstrap(port, coldload, pilot, params);
+        return false;
+    }
+
+    // do fn(warm) with the pilot running
+    template<typename Fn>
+    auto with_pilot(Fn fn)
+    {
+        return call([&]{
+            bool warm = start();
+            if constexpr (std::is_void_v<decltype(fn(warm))>)
+            {
+                fn(warm);
+                this->warm = link.pilot;
+            }
+            else
+            {
+                auto result = fn(warm);
+                this->warm = link.pilot;
+                return result;
+            }
+        });
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+session::session(const std::string& port, options options) :
+    pimpl_{std::make_unique<impl>(port, to_params(options))}
+{ }
+
+session::~session() = default;
+
+void session::on_message(std::function<void(const std::string&)> fn)
+{
+    std::scoped_lock lock{pimpl_->mutex};
+    pimpl_->on_message = std::move(fn);
+}
+
+void session::on_progress(std::function<void(unsigned)> fn)
+{
+    std::scoped_lock lock{pimpl_->mutex};
+    pimpl_->on_progress = std::move(fn);
+}
+
+void session::connect(const std::string& coldload, const std::string& pilot)
+{
+    auto& p = *pimpl_;
+    p.call([&]{
+        p.coldload = read_file(p.ctx, coldload.size() ? coldload : def_coldload);
+        p.pilot    = read_file(p.ctx, pilot.size() ? pilot : def_pilot);
+
+        p.warm = p.warm && find_pilot(p.port, p.params, p.link.baud_rate);
+        if (!p.warm)
+        {
+            bootstrap(p.port, p.coldload, p.pilot, p.params);
+            p.booted = true;
+        }
+    });
+}
+
+target_info session::probe()
+{
+    auto& p = *pimpl_;
+    auto probe = p.with_pilot([&](bool warm){ return probe_target(p.port, p.params, p.link, warm); });
+
+    target_info info;
+    info.cpu_id = probe.cpu_id;
+    info.prod_id = probe.id_block.prod_id;
+    info.flash_id = probe.flash_id;
+    info.ram_size = probe.ram_size * 0x8000ul;
+
+    if (auto it = cpu_info.find(probe.cpu_id); it != cpu_info.end()) info.cpu = it->second;
+    if (auto it = board_info.find(probe.id_block.prod_id); it != board_info.end()) info.board = it->second;
+    if (auto it = flash_info.find(probe.flash_id); it != flash_info.end())
+    {
+        info.flash = it->second.name;
+        info.flash_size = it->second.param.flash_size * 0x1000ul;
+    }
+    return info;
+}
+
+void session::flash(const std::string& program)
+{
+    auto& p = *pimpl_;
+    p.with_pilot([&](bool warm){ send_program(p.port, p.name, load_program(program), p.params, p.link, warm); });
+}
+
+void session::verify(const std::string& program)
+{
+    auto& p = *pimpl_;
+    p.with_pilot([&](bool warm){ verify_program(p.port, load_program(program).image, p.params, p.link, warm); });
+}
+
+std::vector<std::uint8_t> session::read(std::size_t size)
+{
+    auto& p = *pimpl_;
+    return p.with_pilot([&](bool warm){ return read_program(p.port, size, p.params, p.link, warm); });
+}
+
+void session::run()
+{
+    auto& p = *pimpl_;
+    p.with_pilot([&](bool warm){ run_program(p.port, p.params, p.link, warm); });
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+struct rabbit_session
+{
+    rabbit::session session;
+};
+
+namespace
+{
+
+static_assert(static_cast<int>(rabbit::status::ok) == RABBIT_OK);
+static_assert(static_cast<int>(rabbit::status::link_error) == RABBIT_LINK_ERROR);
+static_assert(static_cast<int>(rabbit::status::port_error) == RABBIT_PORT_ERROR);
+static_assert(static_cast<int>(rabbit::status::failed) == RABBIT_FAILED);
+
+thread_local std::string last_error;
+
+// do fn and turn what it throws into a status code
+int call(auto fn)
+try
+{
+    fn();
+    return RABBIT_OK;
+}
+catch (...)
+{
+    auto ep = std::current_exception();
+    try { throw; }
+    catch (const std::exception& e) { last_error = e.what(); }
+    catch (...) { last_error = "Unknown error"; }
+
+    return static_cast<int>(rabbit::status_of(ep));
+}
+
+}
+
+extern "C"
+{
+
+rabbit_session* rabbit_open(const char* port, unsigned flags, unsigned window)
+{
+    rabbit::options options;
+    options.compress = flags & RABBIT_COMPRESS;
+    options.diff = flags & RABBIT_DIFF;
+    options.verify = flags & RABBIT_VERIFY;
+    options.run = flags & RABBIT_RUN;
+    options.ram = flags & RABBIT_RAM;
+    options.slow = flags & RABBIT_SLOW;
+    options.use_cts = flags & RABBIT_CTS;
+    options.use_rts = flags & RABBIT_RTS;
+    if (window) options.window = window;
+
+    rabbit_session* session = nullptr;
+    call([&]{ session = new rabbit_session{ rabbit::session{port, options} }; });
+    return session;
+}
+
+void rabbit_close(rabbit_session* session) { delete session; }
+
+const char* rabbit_error(void) { return last_error.c_str(); }
+
+void rabbit_callbacks(rabbit_session* session, rabbit_message_fn on_message, rabbit_progress_fn on_progress, void* user)
+{
+    if (on_message) session->session.on_message([=](const std::string& line){ on_message(user, line.c_str()); });
+    else session->session.on_message(nullptr);
+
+    if (on_progress) session->session.on_progress([=](unsigned pc){ on_progress(user, pc); });
+    else session->session.on_progress(nullptr);
+}
+
+int rabbit_connect(rabbit_session* session, const char* coldload, const char* pilot)
+{
+    return call([&]{ session->session.connect(coldload ? coldload : "", pilot ? pilot : ""); });
+}
+
+int rabbit_probe(rabbit_session* session, rabbit_info* info)
+{
+    return call([&]{
+        auto probe = session->session.probe();
+        info->cpu_id = probe.cpu_id;
+        info->prod_id = probe.prod_id;
+        info->flash_id = probe.flash_id;
+        info->flash_size = probe.flash_size;
+        info->ram_size = probe.ram_size;
+    });
+}
+
+int rabbit_flash(rabbit_session* session, const char* program)
+{
+    return call([&]{ session->session.flash(program); });
+}
+
+int rabbit_verify(rabbit_session* session, const char* program)
+{
+    return call([&]{ session->session.verify(program); });
+}
+
+int rabbit_read(rabbit_session* session, void* data, size_t size)
+{
+    return call([&]{
+        auto read = session->session.read(size);
+        std::copy(read.begin(), read.end(), static_cast<byte*>(data));
+    });
+}
+
+int rabbit_run(rabbit_session* session)
+{
+    return call([&]{ session->session.run(); });
+}
+
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Dimitry Ishenko
+ * Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+ *
+ * Distributed under the GNU GPL license. See the LICENSE.md file for details.
+ */
+
+/******************************************************************************/
+#ifndef LIBRABBIT_H
+#define LIBRABBIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*******************************************************************************
+ * C interface to librabbit; see librabbit.hpp for details.
+ *
+ * Functions other than rabbit_open() and rabbit_close() return one of
+ * the rabbit_status codes.
+ *
+ * This is a blocking API: each call returns only when the operation is done
+ * or has failed, and can't be cancelled. Every wait on the board is bounded
+ * by the reply timeout, so a dead board fails rather than hangs. Callers
+ * that need to stay responsive run sessions on threads of their own, one
+ * call at a time per session.
+ */
+typedef struct rabbit_session rabbit_session;
+
+enum rabbit_status
+{
+    RABBIT_OK,
+    RABBIT_LINK_ERROR,  /* target not responding, garbled or lost replies */
+    RABBIT_PORT_ERROR,  /* serial port or file failure */
+    RABBIT_FAILED,      /* anything else */
+};
+
+/* option flags */
+enum
+{
+    RABBIT_COMPRESS = 0x01,
+    RABBIT_DIFF     = 0x02,
+    RABBIT_VERIFY   = 0x04,
+    RABBIT_RUN      = 0x08,
+    RABBIT_RAM      = 0x10,
+    RABBIT_SLOW     = 0x20,
+    RABBIT_CTS      = 0x40,
+    RABBIT_RTS      = 0x80,
+};
+
+typedef struct rabbit_info
+{
+    uint32_t cpu_id;
+    uint16_t prod_id;
+    uint16_t flash_id;
+    uint32_t flash_size; /* 0 if the flash type is not supported */
+    uint32_t ram_size;
+}
+rabbit_info;
+
+typedef void (*rabbit_message_fn)(void* user, const char* line);
+typedef void (*rabbit_progress_fn)(void* user, unsigned percent);
+
+/* open session with the board on port; window is the number of packets
+ * in flight (0 for default); returns NULL on failure */
+rabbit_session* rabbit_open(const char* port, unsigned flags, unsigned window);
+void rabbit_close(rabbit_session*);
+
+/* message of the last failure on the calling thread */
+const char* rabbit_error(void);
+
+/* either callback may be NULL */
+void rabbit_callbacks(rabbit_session*, rabbit_message_fn, rabbit_progress_fn, void* user);
+
+/* NULL for the default loaders */
+int rabbit_connect(rabbit_session*, const char* coldload, const char* pilot);
+
+int rabbit_probe(rabbit_session*, rabbit_info*);
+int rabbit_flash(rabbit_session*, const char* program);
+int rabbit_verify(rabbit_session*, const char* program);
+int rabbit_read(rabbit_session*, void* data, size_t size);
+int rabbit_run(rabbit_session*);
+
+#ifdef __cplusplus
+}
+#endif
+
+/******************************************************************************/
+#endif
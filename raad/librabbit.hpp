@@ -0,0 +1,109 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBRABBIT_HPP
+#define LIBRABBIT_HPP
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// librabbit: the raad upload flow for embedding in other programs
+namespace rabbit
+{
+
+// see raad --help for details
+struct options
+{
+    bool compress = false;  // RLE-pack program data, if the pilot supports it
+    bool diff = false;      // only erase and write what has changed
+    bool verify = false;    // read back and verify program after upload
+    bool run = false;       // launch program after upload
+    bool ram = false;       // load program into RAM instead of flash and launch it
+    bool slow = false;      // limit max baud rate to 115200
+    bool use_cts = false;   // use CTS to control the /RESET pin
+    bool use_rts = false;   // use RTS to read the STATUS pin
+    unsigned window = 1;    // packets in flight
+    unsigned retries = 3;   // resends per data chunk
+    unsigned boot_tries = 3;
+    unsigned reply_ms = 1000; // give up on target replies after that
+};
+
+// what the pilot says about the board
+struct target_info
+{
+    std::uint32_t cpu_id = 0;
+    std::uint16_t prod_id = 0;
+    std::uint16_t flash_id = 0;
+    std::size_t flash_size = 0; // 0 if the flash type is not supported
+    std::size_t ram_size = 0;
+    std::string cpu, board, flash; // names, if known
+};
+
+enum class status
+{
+    ok,
+    link_error, // target not responding, garbled or lost replies; worth another try
+    port_error, // serial port or file failure
+    failed,     // anything else (eg, unsupported flash, bad program file)
+};
+
+// what kind of error the exception is
+status status_of(std::exception_ptr);
+
+////////////////////////////////////////////////////////////////////////////////
+// board on a serial port
+//
+// Operations block and throw on failure; they can't be cancelled, but every
+// wait on the board is bounded by reply_ms. They may be called from any
+// thread, one at a time per session. The pilot is kept running between them.
+class session
+{
+public:
+    explicit session(const std::string& port, options = { });
+    ~session();
+
+    session(const session&) = delete;
+    session& operator=(const session&) = delete;
+
+    // output lines (without the newline) and percent done of the current step;
+    // called on the thread running the operation
+    void on_message(std::function<void(const std::string&)>);
+    void on_progress(std::function<void(unsigned)>);
+
+    // bootstrap the board with the loaders (default ones, if empty)
+    // unless its pilot is already running
+    void connect(const std::string& coldload = { }, const std::string& pilot = { });
+
+    target_info probe();
+
+    // program is a .bin, .hex, .ihx or .rpk file
+    void flash(const std::string& program);
+    void verify(const std::string& program);
+
+    std::vector<std::uint8_t> read(std::size_t size);
+    void run();
+
+    // run fn(*this) on a thread of its own; the future is ready when the
+    // (blocking) operation finishes, there is no way to stop it early
+    template<typename Fn>
+    auto async(Fn fn) { return std::async(std::launch::async, std::move(fn), std::ref(*this)); }
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl_;
+};
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+#endif
@@ -0,0 +1,91 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "link.hpp"
+
+#include <algorithm> // std::find_if
+#include <cstdlib> // std::getenv
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h> // getpid
+
+////////////////////////////////////////////////////////////////////////////////
+std::string link_cache::default_path()
+{
+    std::filesystem::path path;
+    if (auto dir = std::getenv("XDG_CACHE_HOME"); dir && *dir) path = dir;
+    else if (auto dir = std::getenv("HOME"); dir && *dir) path = std::filesystem::path{dir} / ".cache";
+    else return { };
+
+    return path / "raad" / "links";
+}
+
+link_cache::link_cache(std::string path) : path_{std::move(path)}
+{
+    if (path_.empty()) return;
+
+    // one profile per line: "port" prod_id baud_rate window chunk_size [pilot]
+    std::ifstream is{path_};
+    for (std::string line; std::getline(is, line); )
+    {
+        std::istringstream iss{line};
+        entry e;
+        if (iss >> std::quoted(e.port) >> std::hex >> e.link.prod_id >> std::dec
+            >> e.link.baud_rate >> e.link.window >> e.link.chunk_size)
+        {
+            iss >> e.link.pilot;
+            entries_.push_back(std::move(e));
+        }
+    }
+}
+
+std::optional<link_profile> link_cache::find(const std::string& port) const
+{
+    std::scoped_lock lock{mutex_};
+
+    auto it = std::find_if(entries_.rbegin(), entries_.rend(), [&](auto& e){ return e.port == port; });
+    if (it != entries_.rend()) return it->link;
+    return std::nullopt;
+}
+
+void link_cache::update(const std::string& port, const link_profile& link)
+{
+    std::scoped_lock lock{mutex_};
+
+    std::erase_if(entries_, [&](auto& e){ return e.port == port && e.link.prod_id == link.prod_id; });
+    entries_.push_back({ port, link });
+    save();
+}
+
+void link_cache::forget(const std::string& port)
+{
+    std::scoped_lock lock{mutex_};
+
+    if (std::erase_if(entries_, [&](auto& e){ return e.port == port; })) save();
+}
+
+void link_cache::save()
+{
+    if (path_.empty()) return;
+
+    // write a temp file and move it in place, so that
+    // other raad instances never see a partial cache
+    std::filesystem::path path{path_}, temp{path_ + "." + std::to_string(getpid())};
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    std::ofstream os{temp};
+    for (auto& e : entries_)
+        os << std::quoted(e.port) << ' ' << std::hex << e.link.prod_id << std::dec << ' '
+           << e.link.baud_rate << ' ' << e.link.window << ' ' << e.link.chunk_size << ' ' << e.link.pilot << '\n';
+    os.close();
+
+    if (os) std::filesystem::rename(temp, path, ec);
+}
@@ -0,0 +1,60 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#ifndef LINK_HPP
+#define LINK_HPP
+
+#include "types.hpp"
+
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// link profile that worked with a board on a port
+struct link_profile
+{
+    word prod_id = 0;
+    unsigned baud_rate = 0;
+    unsigned window = 0;
+    unsigned chunk_size = 0;
+    bool pilot = false; // pilot was left running
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// link profiles remembered between runs; safe to share between threads
+struct link_cache
+{
+    // $XDG_CACHE_HOME/raad/links or ~/.cache/raad/links
+    static std::string default_path();
+
+    explicit link_cache(std::string path);
+
+    // profile last used on the port
+    std::optional<link_profile> find(const std::string& port) const;
+
+    // remember profile and write the cache out
+    void update(const std::string& port, const link_profile&);
+    void forget(const std::string& port);
+
+private:
+    struct entry
+    {
+        std::string port;
+        link_profile link;
+    };
+
+    std::string path_;
+    std::vector<entry> entries_; // least recent first
+    mutable std::mutex mutex_;
+
+    void save();
+};
+
+////////////////////////////////////////////////////////////////////////////////
+#endif
@@ -5,20 +5,56 @@
 // Distributed under the GNU GPL license. See the LICENSE.md file for details.
 
 ////////////////////////////////////////////////////////////////////////////////
+#include "daemon.hpp"
 #include "file.hpp"
+#include "image.hpp"
+#include "link.hpp"
+#include "message.hpp"
+#include "pack.hpp"
 #include "pgm/args.hpp"
 #include "raad.hpp"
 #include "serial.hpp"
 
+#include <algorithm> // std::max, std::min
 #include <asio.hpp>
 #include <exception>
 #include <filesystem>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 ////////////////////////////////////////////////////////////////////////////////
 constexpr auto def_coldload = BIOS_DIR "/coldload.bin";
 constexpr auto def_pilot = BIOS_DIR "/pilot.bin";
 
+void upload(asio::io_context& ctx, const std::string& name, const payload& coldload, const payload& pilot, const pack& program, const params& params, link_cache& cache, bool use_cached)
+try
+{
+    auto link = cache.find(name).value_or(link_profile{ });
+    if (!use_cached) link.window = link.chunk_size = 0;
+
+    auto port = open_serial(ctx, name);
+
+    // skip bootstrap if the pilot from the previous run is still alive
+    bool warm = link.pilot && find_pilot(port, params, link.baud_rate);
+    if (!warm) bootstrap(port, coldload, pilot, params);
+
+    send_program(port, name, program, params, link, warm);
+
+    cache.update(name, link);
+}
+catch (...)
+{
+    // start from scratch next time
+    cache.forget(name);
+    throw;
+}
+
 int main(int argc, char* argv[])
 try
 {
@@ -28,22 +64,52 @@ try
     {
         { "-1", "--coldload", "path",       "Use custom initial loader."            },
         { "-2", "--pilot", "path",          "Use custom secondary loader."          },
-        { "-p", "--port", "name", pgm::req, "Serial port to use for upload (required)." },
+        { "-c", "--compress",               "Send program data RLE-packed, if the pilot supports it." },
+        { "-d", "--diff",                   "Only erase and write what has changed."  },
+        { "-D", "--daemon",                 "Keep boards on the ports bootstrapped and serve\n"
+                                            "upload jobs over a Unix socket." },
+        { "-p", "--port", "name", pgm::mul, "Serial port to use for upload (required).\n"
+                                            "Repeat or pass a comma-separated list to upload to several\n"
+                                            "boards at once." },
+        { "-P", "--pack", "path",           "Frame program ahead of time into a pack file (.rpk)\n"
+                                            "at path and exit; -c and -w apply." },
         { "-r", "--run",                    "Launch program after upload."          },
+        {       "--ram",                    "Load program into RAM instead of flash and launch it." },
         { "-s", "--slow",                   "Limit max baud rate to 115200."        },
+        { "-S", "--socket", "path",         "Send upload job to the daemon listening on path.\n"
+                                            "With -D, listen on path (default: " + default_socket() + ")." },
+        { "-t", "--timeout", "ms",          "Give up on target replies after ms milliseconds (default: 1000)." },
+        { "-V", "--verify",                 "Read back and verify program after upload." },
+        { "-w", "--window", "N",            "Keep up to N packets in flight (default: 1).\n"
+                                            "N > 1 needs pilot.bin rebuilt from bios/pilot.c with\n"
+                                            "PB_PIPELINED_RX; otherwise raad falls back to 1." },
+        {       "--boot-backoff", "ms",     "Wait n*ms milliseconds before bootstrap attempt n+1 (default: 500)." },
+        {       "--boot-time", "ms",        "Give target ms milliseconds to come out of reset (default: 350)." },
+        {       "--boot-tries", "N",        "Try bootstrapping the target up to N times (default: 3)." },
         {       "--cts",                    "Use CTS to control the /RESET pin."    },
+        {       "--flash-id", "id",         "With -P, only allow flash of type id." },
+        {       "--no-cache",               "Don't remember link settings between runs." },
+        {       "--retries", "N",           "Resend a data chunk, or reconnect to a dropped port,\n"
+                                            "up to N times (default: 3)." },
+        {       "--reset-time", "ms",       "Hold target in reset for ms milliseconds (default: 250)." },
         {       "--rts",                    "Use RTS to read the STATUS pin.\n"     },
 
         { "-h", "--help",                   "Show this help screen and exit."       },
         { "-v", "--version",                "Show version and exit."                },
 
-        { "program.bin",                    "Path to program to be uploaded."       },
+        { "program.bin", pgm::opt,          "Path to program to be uploaded (.bin, .hex, .ihx or .rpk)." },
     };
 
     std::exception_ptr ep;
     try { args.parse(argc, argv); }
     catch (...) { ep = std::current_exception(); }
 
+    if (!ep && !args["-D"] && !args["program.bin"])
+        ep = std::make_exception_ptr(pgm::missing_argument{"param 'program.bin' is required"});
+
+    if (!ep && !args["-P"] && !args["-p"])
+        ep = std::make_exception_ptr(pgm::missing_argument{"option '-p, --port' is required"});
+
     if (args["--help"])
     {
         std::cout << args.usage(name) << std::endl;
@@ -60,24 +126,110 @@ try
     else
     {
         asio::io_context ctx;
-        auto port = open_serial(ctx, args["-p"].value());
 
-        auto coldload = read_file(ctx, args["-1"].value_or(def_coldload));
-        auto pilot    = read_file(ctx, args["-2"].value_or(def_pilot));
-        auto program  = read_file(ctx, args["program.bin"].value());
+        std::vector<std::string> ports;
+        for (auto& value : args["-p"].values())
+            for (std::size_t pos = 0, end; pos <= value.size(); pos = end + 1)
+            {
+                end = std::min(value.find(',', pos), value.size());
+                if (end > pos) ports.push_back(value.substr(pos, end - pos));
+            }
 
         params params;
+        params.compress = !!args["-c"];
+        params.diff = !!args["-d"];
         params.run = !!args["-r"];
+        params.run_in_ram = !!args["--ram"];
         params.slow = !!args["-s"];
         params.use_cts = !!args["--cts"];
         params.use_rts = !!args["--rts"];
+        params.verify = !!args["-V"];
+        if (args["-w"]) params.window = std::max(std::stoi(args["-w"].value()), 1);
+        if (args["-t"]) params.reply_time = msec{std::stoi(args["-t"].value())};
+        if (args["--boot-backoff"]) params.boot_backoff = msec{std::stoi(args["--boot-backoff"].value())};
+        if (args["--boot-tries"]) params.boot_tries = std::max(std::stoi(args["--boot-tries"].value()), 1);
+        if (args["--boot-time"]) params.boot_time = msec{std::stoi(args["--boot-time"].value())};
+        if (args["--retries"]) params.retries = std::max(std::stoi(args["--retries"].value()), 0);
+        if (args["--reset-time"]) params.reset_time = msec{std::stoi(args["--reset-time"].value())};
+
+        if (args["-P"])
+        {
+            pack pack{ read_image(args["program.bin"].value()), { } };
+            if (args["--flash-id"]) pack.flash_id = std::stoi(args["--flash-id"].value(), nullptr, 0);
+
+            do_("Framing program", [&]{ pack.frames = frame_image(pack.image, params); });
+            write_pack(ctx, args["-P"].value(), pack);
+            return 0;
+        }
+
+        auto socket = args["-S"].value_or(default_socket());
+
+        if (args["-D"])
+        {
+            auto coldload = read_file(ctx, args["-1"].value_or(def_coldload));
+            auto pilot    = read_file(ctx, args["-2"].value_or(def_pilot));
+
+            run_daemon(ctx, socket, ports, coldload, pilot, params);
+            return 0;
+        }
+
+        payload coldload, pilot;
+        pack program;
+        std::function<void(const std::string&)> upload_to;
+
+        // cached window & chunk size only apply if -w was not given
+        link_cache cache{args["--no-cache"] || args["-S"] ? "" : link_cache::default_path()};
+        bool use_cached = !args["-w"];
+
+        if (args["-S"])
+        {
+            auto path = std::filesystem::absolute(args["program.bin"].value()).string();
+            upload_to = [&, path](const std::string& port){
+                std::ostringstream job;
+                job << "flash " << std::quoted(port) << ' ' << std::quoted(path);
+                if (params.compress) job << " compress";
+                if (params.diff) job << " diff";
+                if (params.verify) job << " verify";
+                if (params.run) job << " run";
+                if (params.run_in_ram) job << " ram";
+
+                if (!send_job(socket, job.str())) throw std::runtime_error{"Job failed"};
+            };
+        }
+        else
+        {
+            coldload = read_file(ctx, args["-1"].value_or(def_coldload));
+            pilot    = read_file(ctx, args["-2"].value_or(def_pilot));
+            program  = load_program(args["program.bin"].value());
+
+            upload_to = [&](const std::string& port){
+                upload(ctx, port, coldload, pilot, program, params, cache, use_cached);
+            };
+        }
+
+        if (ports.size() == 1) upload_to(ports[0]);
+        else
+        {
+            // one thread per board; the images are shared read-only
+            std::vector<std::string> errors(ports.size());
+            std::vector<std::thread> threads;
 
-        reset_target(port, params);
-        detect_target(port, params);
+            for (std::size_t n = 0; n < ports.size(); ++n)
+                threads.emplace_back([&, n]{
+                    message_prefix(ports[n] + ": ");
+                    try { upload_to(ports[n]); }
+                    catch (const std::exception& e) { errors[n] = e.what(); }
+                });
+            for (auto& thread : threads) thread.join();
 
-        send_coldload(port, coldload, params);
-        send_pilot(port, pilot);
-        send_program(port, program, params);
+            std::size_t failed = 0;
+            for (std::size_t n = 0; n < ports.size(); ++n)
+            {
+                if (errors[n].size()) ++failed;
+                message(ports[n], ": ", errors[n].empty() ? "PASS" : "FAIL (" + errors[n] + ")", '\n');
+            }
+            if (failed) throw std::runtime_error{std::to_string(failed) + " of " + std::to_string(ports.size()) + " boards failed"};
+        }
     }
 
     return 0;
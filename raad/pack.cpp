@@ -0,0 +1,179 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "file.hpp"
+#include "message.hpp"
+#include "pack.hpp"
+
+#include <cstdint>
+#include <cstring> // std::memcmp, std::memcpy
+#include <filesystem>
+#include <stdexcept>
+
+////////////////////////////////////////////////////////////////////////////////
+namespace
+{
+
+constexpr byte magic[] = "RPK";
+constexpr word version = 1;
+
+#pragma pack(push, 1)
+struct pack_head
+{
+    byte magic[4];
+    word version;
+    word flash_id;
+    dword chunk_size;
+    dword num_segs;
+    dword num_chunks;
+    dword data_size;
+    dword frames_size;
+    std::uint64_t hash;
+};
+
+struct pack_segment
+{
+    dword address;
+    dword size;
+};
+
+struct pack_chunk
+{
+    dword offset;
+    word size;
+    dword pos;
+    word length;
+    byte tag;
+    byte packed;
+    word check;
+};
+#pragma pack(pop)
+
+// http://www.isthe.com/chongo/tech/comp/fnv/
+struct fnv1a
+{
+    std::uint64_t hash = 0xcbf29ce484222325;
+    void put(std::span<const byte> data) { for (auto b : data) hash = (hash ^ b) * 0x100000001b3; }
+};
+
+template<typename T>
+auto as_bytes(const T& data) { return std::span<const byte>{ addressof(data), sizeof(data) }; }
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void write_pack(asio::io_context& ctx, const std::string& path, const pack& pack)
+{
+    auto& segs = pack.image.segments();
+    auto& chunks = pack.frames.chunks;
+
+    pack_head head{ };
+    std::memcpy(head.magic, magic, sizeof(head.magic));
+    head.version = version;
+    head.flash_id = pack.flash_id;
+    head.chunk_size = chunks.size() ? chunks.front().size : 0;
+    head.num_segs = segs.size();
+    head.num_chunks = chunks.size();
+    head.data_size = pack.image.used();
+    head.frames_size = pack.frames.data.size();
+
+    payload body;
+    for (auto& seg : segs)
+    {
+        pack_segment ps{ seg.address, static_cast<dword>(seg.data.size()) };
+        body.insert(body.end(), addressof(ps), addressof(ps) + sizeof(ps));
+    }
+    for (auto& fr : chunks)
+    {
+        pack_chunk pc{ fr.offset, static_cast<word>(fr.size), static_cast<dword>(fr.pos), static_cast<word>(fr.length), fr.tag, fr.packed, fr.check };
+        body.insert(body.end(), addressof(pc), addressof(pc) + sizeof(pc));
+    }
+
+    fnv1a fnv;
+    fnv.put(body);
+    for (auto& seg : segs) fnv.put(seg.data);
+    fnv.put(pack.frames.data);
+    head.hash = fnv.hash;
+
+    auto file = open_file(ctx, path, flags::write_only | flags::create | flags::truncate);
+    do_("Writing pack", [&]{
+        asio::write(file, asio::buffer(addressof(head), sizeof(head)));
+        asio::write(file, asio::buffer(body));
+        for (auto& seg : segs) asio::write(file, asio::buffer(seg.data.data(), seg.data.size()));
+        asio::write(file, asio::buffer(pack.frames.data.data(), pack.frames.data.size()));
+
+        doing(head.num_chunks, " frames, ", to_human(file.size()));
+    });
+}
+
+pack read_pack(const std::string& path)
+{
+    auto file = map_file(path);
+
+    pack pack;
+    do_("Checking pack", [&]{
+        auto data = file.data();
+
+        pack_head head;
+        if (data.size() < sizeof(head)) throw std::runtime_error{"Invalid pack file"};
+        std::memcpy(&head, data.data(), sizeof(head));
+
+        if (std::memcmp(head.magic, magic, sizeof(head.magic))) throw std::runtime_error{"Invalid pack file"};
+        if (head.version != version) throw std::runtime_error{"Unsupported pack version " + std::to_string(head.version)};
+
+        auto body = data.subspan(sizeof(head));
+        auto tables = head.num_segs * sizeof(pack_segment) + head.num_chunks * sizeof(pack_chunk);
+        if (body.size() != tables + head.data_size + head.frames_size) throw std::runtime_error{"Truncated pack file"};
+
+        fnv1a fnv;
+        fnv.put(body);
+        if (fnv.hash != head.hash) throw std::runtime_error{"Pack file checksum error"};
+
+        auto table = body.data();
+        auto seg_data = body.subspan(tables, head.data_size);
+        auto frames_data = body.subspan(tables + head.data_size);
+
+        std::vector<segment> segs;
+        for (size_t n = 0, pos = 0; n < head.num_segs; ++n, table += sizeof(pack_segment))
+        {
+            pack_segment ps;
+            std::memcpy(&ps, table, sizeof(ps));
+
+            if (pos + ps.size > seg_data.size() || (segs.size() && ps.address < segs.back().end()))
+                throw std::runtime_error{"Invalid pack segment"};
+
+            segs.push_back({ ps.address, seg_data.subspan(pos, ps.size) });
+            pos += ps.size;
+        }
+
+        size_t size = segs.size() ? segs.back().end() : 0;
+        for (size_t n = 0; n < head.num_chunks; ++n, table += sizeof(pack_chunk))
+        {
+            pack_chunk pc;
+            std::memcpy(&pc, table, sizeof(pc));
+
+            if (pc.pos + pc.length > frames_data.size() || pc.offset + pc.size > size)
+                throw std::runtime_error{"Invalid pack chunk"};
+            pack.frames.chunks.push_back({ pc.offset, pc.size, pc.pos, pc.length, pc.tag, !!pc.packed, pc.check });
+        }
+
+        pack.frames.data = frames_data;
+        pack.flash_id = head.flash_id;
+        pack.image = image{std::move(file), std::move(segs)};
+
+        doing(head.num_chunks, " frames");
+    });
+    return pack;
+}
+
+pack load_program(const std::string& path)
+{
+    if (std::filesystem::path{path}.extension() == ".rpk") return read_pack(path);
+    return pack{ read_image(path), { } };
+}
+
+////////////////////////////////////////////////////////////////////////////////
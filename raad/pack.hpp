@@ -0,0 +1,68 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#ifndef PACK_HPP
+#define PACK_HPP
+
+#include "image.hpp"
+#include "types.hpp"
+
+#include <asio.hpp>
+#include <span>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// data chunk framed ahead of time
+struct frame
+{
+    dword offset;
+    size_t size;        // size of the chunk data
+    size_t pos, length; // escaped packet in frames::data
+    byte tag;
+    bool packed;
+    word check;         // fletcher8 of the escaped packet
+};
+
+struct frames
+{
+    std::vector<frame> chunks;
+    std::span<const byte> data; // escaped packets
+    payload buffer;             // backs data, unless it is mapped
+
+    frames() = default;
+    frames(frames&&) = default;
+    frames& operator=(frames&&) = default;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// program image with its chunks (optionally) framed ahead of time
+struct pack
+{
+    ::image image;
+    ::frames frames;
+    word flash_id = 0; // only for this flash type (0 = any)
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// pack file (.rpk) layout:
+//
+//   pack_head
+//   pack_segment[num_segs]
+//   pack_chunk[num_chunks]
+//   segment data
+//   escaped packets
+//
+// all little-endian; hash is 64-bit FNV-1a of everything past the head
+void write_pack(asio::io_context&, const std::string& path, const pack&);
+pack read_pack(const std::string& path);
+
+// read pack file or plain image
+pack load_program(const std::string& path);
+
+////////////////////////////////////////////////////////////////////////////////
+#endif
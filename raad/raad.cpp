@@ -6,12 +6,22 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 #include "message.hpp"
+#include "packet.hpp"
 #include "raad.hpp"
 #include "rabbit.hpp"
+#include "rle.hpp"
 #include "serial.hpp"
 #include "types.hpp"
 
-#include <algorithm> // std::copy
+#include <algorithm> // std::all_of, std::any_of, std::copy, std::count, std::fill, std::find, std::max, std::min, std::mismatch
+#include <chrono>
+#include <deque>
+#include <functional> // std::cref
+#include <future>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
 #include <stdexcept>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -31,24 +41,55 @@ constexpr byte status_lo[] = "\x80\x0e\x20";
 // ioi ld (SPCR), 0x80
 constexpr byte start_pgm[] = "\x80\x24\x80";
 
+// write data, allowing for its time on the line plus write_time;
+// with drain, also wait for it to leave the port
+void send_bytes(asio::serial_port& port, std::span<const byte> data, const params& params, bool drain = true)
+{
+    auto timeout = line_time(port, data.size()) + params.write_time;
+    if (!write_for(port, data, timeout) || (drain && !drain_for(port, timeout)))
+        throw link_error{"Port stalled"};
+}
+
+// read exactly data.size() bytes
+void recv_bytes(asio::serial_port& port, std::span<byte> data, const params& params)
+{
+    if (!read_for(port, data, line_time(port, data.size()) + params.reply_time))
+        throw link_error{"Target not responding"};
+}
+
+// poll the /STATUS pin until it goes to state or the timeout expires
+bool wait_status(asio::serial_port& port, const params& params, bool state)
+{
+    auto deadline = std::chrono::steady_clock::now() + params.status_time;
+    for (;;)
+    {
+        // the pin is inverted
+        if ((params.use_cts ? cts(port) : dsr(port)) != state) return true;
+        if (std::chrono::steady_clock::now() >= deadline) return false;
+        sleep_for(1ms);
+    }
+}
+
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 void reset_target(asio::serial_port& port, const params& params)
 {
     do_("Resetting target", [&]{
+        // the bootstrap triplets can't resync if the target starts listening
+        // half-way through one, so there is nothing to poll here
         if (params.use_rts) {
             rts(port, hi);
-            sleep_for(250ms);
+            sleep_for(params.reset_time);
 
             rts(port, lo);
-            sleep_for(350ms);
+            sleep_for(params.boot_time);
         } else {
             dtr(port, hi);
-            sleep_for(250ms);
+            sleep_for(params.reset_time);
 
             dtr(port, lo);
-            sleep_for(350ms);
+            sleep_for(params.boot_time);
         }
     });
 }
@@ -60,25 +101,19 @@ void detect_target(asio::serial_port& port, const params& params)
 
         // disable watchdog
         doing("W");
-        asio::write(port, asio::buffer(disable_wd, size(disable_wd)));
+        send_bytes(port, { disable_wd, size(disable_wd) }, params, false);
 
         // tell Rabbit to set the /STATUS pin high
         doing("H");
-        asio::write(port, asio::buffer(status_hi, size(status_hi)));
-        drain(port);
+        send_bytes(port, { status_hi, size(status_hi) }, params);
 
-        // check the /STATUS pin (inverted)
-        sleep_for(100ms);
-        if (params.use_cts ? cts(port) : dsr(port)) throw std::runtime_error{"Target not responding"};
+        if (!wait_status(port, params, hi)) throw link_error{"Target not responding"};
 
         // tell Rabbit to set the /STATUS pin low
         doing("L");
-        asio::write(port, asio::buffer(status_lo, size(status_lo)));
-        drain(port);
+        send_bytes(port, { status_lo, size(status_lo) }, params);
 
-        // check the /STATUS pin (inverted)
-        sleep_for(100ms);
-        if (params.use_cts ? !cts(port) : !dsr(port)) throw std::runtime_error{"Target not responding"};
+        if (!wait_status(port, params, lo)) throw link_error{"Target not responding"};
     });
 }
 
@@ -89,230 +124,707 @@ void send_coldload(asio::serial_port& port, const payload& data, const params& p
         baud_rate(port, 2400);
 
         // send loader without the final triplet (see bootstrapping.md)
-        send_data(port, data, data.size() - 3);
+        auto loader_size = data.size() - 3;
+        if (!send_data(port, data, line_time(port, loader_size) + params.write_time, loader_size)) throw link_error{"Port stalled"};
 
         // tell Rabbit to set the /STATUS pin high
         doing("H");
-        asio::write(port, asio::buffer(status_hi, size(status_hi)));
+        send_bytes(port, { status_hi, size(status_hi) }, params, false);
 
         // send the final triplet
         doing("F");
-        asio::write(port, asio::buffer(start_pgm, size(start_pgm)));
-        drain(port);
+        send_bytes(port, { start_pgm, size(start_pgm) }, params);
 
-        // check the /STATUS pin (inverted)
-        sleep_for(100ms);
-        if (params.use_cts ? cts(port) : dsr(port)) throw std::runtime_error{"Target not responding"};
+        if (!wait_status(port, params, hi)) throw link_error{"Target not responding"};
     });
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-void send_pilot(asio::serial_port& port, const payload& data)
+void send_pilot(asio::serial_port& port, const payload& data, const params& params)
 {
     do_("Sending secondary loader", [&]{
         baud_rate(port, 57600);
         flush(port, que_in);
 
         pilot_head head;
-        head.address = 0x4000;
+        head.address = pilot_start;
         head.size = data.size();
         head.check = checksum(addressof(head), sizeof(head) - sizeof(head.check));
 
         doing("H");
-        asio::write(port, asio::buffer(addressof(head), sizeof(head)));
-        drain(port);
+        send_bytes(port, { addressof(head), sizeof(head) }, params);
 
         doing("C");
         byte check;
-        asio::read(port, asio::buffer(addressof(check), sizeof(check)));
-        if (head.check != check) throw std::runtime_error{
+        recv_bytes(port, { addressof(check), sizeof(check) }, params);
+        if (head.check != check) throw link_error{
             "Checksum error: local=" + to_hex(head.check) + " remote=" + to_hex(check)
         };
 
-        send_data(port, data);
+        if (!send_data(port, data, line_time(port, data.size()) + params.write_time)) throw link_error{"Port stalled"};
         auto fsl = fletcher8(data.data(), data.size());
 
         doing("C");
         word fsr;
-        asio::read(port, asio::buffer(addressof(fsr), sizeof(fsr)));
-        if (fsl != fsr) throw std::runtime_error{
+        recv_bytes(port, { addressof(fsr), sizeof(fsr) }, params);
+        if (fsl != fsr) throw link_error{
             "Checksum error: local=" + to_hex(fsl) + " remote=" + to_hex(fsr)
         };
     });
 }
 
-////////////////////////////////////////////////////////////////////////////////
-namespace
+void bootstrap(asio::serial_port& port, const payload& coldload, const payload& pilot, const params& params)
 {
+    for (unsigned n = 1;; ++n)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto took = [&]{ return std::chrono::duration_cast<msec>(std::chrono::steady_clock::now() - start).count(); };
+        try
+        {
+            reset_target(port, params);
+            detect_target(port, params);
 
-void add_escaped(payload& packet, const byte* data, size_t size)
-{
-    // assume 10% of data needs to be escaped
-    packet.reserve(packet.size() + size + size / 10);
+            send_coldload(port, coldload, params);
+            send_pilot(port, pilot, params);
 
-    for (auto end = data + size; data != end; ++data)
-        if (*data == TC_FRAMING_START || *data == TC_FRAMING_ESC)
+            message("Bootstrap attempt ", n, " took ", took(), "ms\n");
+            return;
+        }
+        catch (const link_error& e)
         {
-            packet.push_back(TC_FRAMING_ESC);
-            packet.push_back(*data & ~0x20); // 7d -> 7d 5d, 7e -> 7d 5e
+            message("Bootstrap attempt ", n, " failed after ", took(), "ms: ", e.what(), '\n');
+            if (n >= params.boot_tries) throw;
+
+            // whatever the target was up to, it gets reset again
+            flush(port, que_both);
+            sleep_for(params.boot_backoff * n);
         }
-        else packet.push_back(*data);
+    }
 }
 
-void send_packet(asio::serial_port& port, byte subtype, const byte* data, size_t size)
+////////////////////////////////////////////////////////////////////////////////
+namespace
 {
-    packet_head head;
-    head.version    = TC_VERSION;
-    head.flags      = 0;
-    head.type       = TC_TYPE_SYSTEM;
-    head.subtype    = subtype;
-    head.data_size  = size;
-    head.check      = fletcher8(addressof(head), sizeof(head) - sizeof(head.check));
-
-    auto check = fletcher8(addressof(head), sizeof(head));
-    check = fletcher8(check, data, size);
 
-    payload packet{ TC_FRAMING_START };
-    add_escaped(packet, addressof(head), sizeof(head));
-    add_escaped(packet, data, size);
-    add_escaped(packet, addressof(check), sizeof(check));
-
-    asio::write(port, asio::buffer(packet));
-    drain(port);
+// pilot session: the port with reusable send & receive buffers
+struct session
+{
+    session(asio::serial_port& port, const ::params& params) : port{port}, params{params}, rx{port} { }
+
+    asio::serial_port& port;
+    const ::params& params;
+    dword base = flash_address; // where program offsets start
+    bool extended = false;      // pilot was built from our pilot.c
+    bool pipelined = false;     // ...with PB_PIPELINED_RX
+    byte request_tag = 0;       // tag of the last request() attempt
+    rx_buffer rx;
+    packet_decoder decoder;
+    packet_buffer packet;
+};
+
+// how often to repeat a request while the pilot is starting up or switching baud rate
+constexpr msec retry_time = 50ms;
+
+void send_packet(session& session, byte subtype, std::span<const byte> data = { }, byte tag = 0)
+{
+    send_bytes(session.port, encode_packet(session.packet, subtype, data, tag), session.params);
 }
-void send_packet(asio::serial_port& port, byte subtype) { send_packet(port, subtype, nullptr, 0); }
 
-////////////////////////////////////////////////////////////////////////////////
-auto read_escaped(asio::serial_port& port, size_t size)
+using reply = std::tuple<bool, std::span<const byte>, byte>; // is_ack, payload, tag
+
+std::optional<reply> try_recv_packet(session& session, byte subtype, msec timeout)
 {
-    payload packet(size);
-    for (auto data = packet.data(), end = data + size; data != end; ++data)
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;)
     {
-        byte c;
-        asio::read(port, asio::buffer(addressof(c), sizeof(c)));
-        if (c == TC_FRAMING_ESC)
+        auto left = std::chrono::duration_cast<msec>(deadline - std::chrono::steady_clock::now());
+        if (!session.rx.wait(std::max(left, 0ms))) return std::nullopt;
+
+        auto [used, done] = session.decoder.put(session.rx.peek());
+        session.rx.skip(used);
+        if (!done) continue;
+
+        auto& head = session.decoder.head();
+        if (head.type == TC_TYPE_SYSTEM && (head.subtype & TC_SUBTYPE_MASK) == subtype)
         {
-            asio::read(port, asio::buffer(addressof(c), sizeof(c)));
-            *data = c | 0x20;
+            auto data = session.decoder.data();
+
+            auto fsl = fletcher8(addressof(head), sizeof(head));
+            fsl = fletcher8(fsl, data.data(), data.size());
+
+            auto fsr = session.decoder.check();
+            if (fsl != fsr) throw link_error{
+                "Checksum error: local=" + to_hex(fsl) + " remote=" + to_hex(fsr)
+            };
+
+            bool is_ack = head.subtype & TC_ACK;
+            return reply{is_ack, data, head.flags};
         }
-        else *data = c;
     }
-    return packet;
 }
 
-auto recv_packet(asio::serial_port& port, byte subtype)
+auto recv_packet(session& session, byte subtype, msec timeout)
 {
-    for (;;)
-    {
-        byte c = 0;
-        asio::read(port, asio::buffer(addressof(c), sizeof(c)));
-        if (c == TC_FRAMING_START)
-        {
-            auto chunk = read_escaped(port, sizeof(packet_head));
-            auto head = new (chunk.data()) packet_head;
-            if (head->type == TC_TYPE_SYSTEM && (head->subtype & TC_SUBTYPE_MASK) == subtype)
-            {
-                bool is_ack = head->subtype & TC_ACK;
-                auto payload = read_escaped(port, head->data_size);
-
-                auto chunk = read_escaped(port, sizeof(word));
-                auto fsr = new (chunk.data()) word;
+    auto reply = try_recv_packet(session, subtype, timeout);
+    if (!reply) throw link_error{"Target not responding"};
+    return *reply;
+}
 
-                auto fsl = fletcher8(addressof(*head), sizeof(*head));
-                fsl = fletcher8(fsl, payload.data(), payload.size());
+auto recv_packet(session& session, byte subtype)
+{
+    return recv_packet(session, subtype, session.params.reply_time);
+}
 
-                if (fsl != *fsr) throw std::runtime_error{
-                    "Checksum error: local=" + to_hex(fsl) + " remote=" + to_hex(*fsr)
-                };
+// keep repeating request until the pilot replies or reply_time runs out;
+// each attempt has its own tag, so that a late reply to an earlier request
+// (eg, SETBAUDRATE at the previous rate) is not taken for this one
+auto request(session& session, byte subtype, std::span<const byte> data = { })
+{
+    auto deadline = std::chrono::steady_clock::now() + session.params.reply_time;
+    auto first = static_cast<byte>(session.request_tag + 1);
+    for (;;)
+    {
+        auto tag = ++session.request_tag;
+        send_packet(session, subtype, data, tag);
 
-                return std::tuple{is_ack, std::move(payload)};
-            }
-            else /* warning? */;
+        auto retry = std::chrono::steady_clock::now() + retry_time;
+        while (auto reply = try_recv_packet(session, subtype, std::chrono::duration_cast<msec>(retry - std::chrono::steady_clock::now())))
+        {
+            // any attempt at this request will do
+            auto [is_ack, payload, reply_tag] = *reply;
+            if (static_cast<byte>(reply_tag - first) <= static_cast<byte>(tag - first)) return *reply;
         }
+
+        if (std::chrono::steady_clock::now() >= deadline) throw link_error{"Target not responding"};
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-auto find_baud_rate(asio::serial_port& port, const params& params)
+auto find_baud_rate(session& session, unsigned cached)
 {
-    sleep_for(100ms);
-    auto rate = params.slow ? (max_baud_rate / 4) : max_baud_rate;
+    auto rate = session.params.slow ? (max_baud_rate / 4) : max_baud_rate;
+
+    // try the rate that worked last time first, unless it is too fast
+    if (cached && cached <= rate)
+    {
+        doing(cached);
+        auto [is_ack, payload, tag] = request(session, TC_SYSTEM_SETBAUDRATE, { addressof(cached), sizeof(cached) });
+
+        if (is_ack) return cached;
+    }
+
     for (; rate >= min_baud_rate; rate /= 2)
     {
         doing(rate);
-        send_packet(port, TC_SYSTEM_SETBAUDRATE, addressof(rate), sizeof(rate));
-        auto [is_ack, payload] = recv_packet(port, TC_SYSTEM_SETBAUDRATE);
+        auto [is_ack, payload, tag] = request(session, TC_SYSTEM_SETBAUDRATE, { addressof(rate), sizeof(rate) });
 
         if (is_ack) return rate;
-
-        sleep_for(250ms);
     }
     throw std::runtime_error{"No suitable baud rate"};
 }
 
-auto recv_info(asio::serial_port& port)
+auto recv_info(session& session)
 {
-    sleep_for(100ms);
-    send_packet(port, TC_SYSTEM_INFOPROBE);
-    auto [is_ack, payload] = recv_packet(port, TC_SYSTEM_INFOPROBE);
+    auto [is_ack, payload, tag] = request(session, TC_SYSTEM_INFOPROBE);
 
     if (!is_ack) throw std::runtime_error{"Error getting info data"};
     if (payload.size() != sizeof(info_probe)) throw std::runtime_error{"Invalid info data"};
 
-    auto info = new (payload.data()) info_probe;
-    return *info;
+    info_probe info;
+    std::copy(payload.begin(), payload.end(), addressof(info));
+    return info;
+}
+
+// check if the pilot has our extensions (sector erase and packed writes);
+// a stock pilot NAKs an empty sector erase, ours ACKs it with its features
+void probe_extensions(session& session)
+{
+    erase_data range{ };
+    auto [is_ack, payload, tag] = request(session, TC_SYSTEM_ERASESECTORS, { addressof(range), sizeof(range) });
+
+    session.extended = is_ack;
+    session.pipelined = is_ack && payload.size() && (payload[0] & TC_PILOT_PIPELINED);
 }
 
-void send_flash_data(asio::serial_port& port, const flash_data& flash)
+void send_flash_data(session& session, const flash_data& flash)
 {
-    sleep_for(100ms);
-    send_packet(port, TC_SYSTEM_FLASHDATA, addressof(flash.param), sizeof(flash.param));
-    auto [is_ack, payload] = recv_packet(port, TC_SYSTEM_FLASHDATA);
+    send_packet(session, TC_SYSTEM_FLASHDATA, { addressof(flash.param), sizeof(flash.param) });
+    auto [is_ack, payload, tag] = recv_packet(session, TC_SYSTEM_FLASHDATA);
 
     if (!is_ack) throw std::runtime_error{"Error setting flash parameters"};
 }
 
-void erase_flash(asio::serial_port& port, dword program_size)
+// erase sectors from 0 through the one holding address
+void erase_flash(session& session, dword address)
 {
-    sleep_for(100ms);
-    send_packet(port, TC_SYSTEM_ERASEFLASH, addressof(program_size), sizeof(program_size));
-    auto [is_ack, payload] = recv_packet(port, TC_SYSTEM_ERASEFLASH);
+    send_packet(session, TC_SYSTEM_ERASEFLASH, { addressof(address), sizeof(address) });
+    auto [is_ack, payload, tag] = recv_packet(session, TC_SYSTEM_ERASEFLASH, session.params.erase_time);
 
     if (!is_ack) throw std::runtime_error{"Error erasing flash"};
 }
 
-void send_chunk(asio::serial_port& port, dword offset, const byte* data, size_t size)
+// page-write parts (AT29, SST29) reprogram a whole page on every write;
+// erasing them sector by sector gains nothing over one chip erase
+bool page_write(const flash_data& flash)
+{
+    return flash.param.write_mode == 2 || flash.param.write_mode == 4;
+}
+
+// sector size if the flash has uniform sectors worth erasing one by one, or 0
+size_t sector_size(const flash_data& flash)
+{
+    auto& param = flash.param;
+    if (page_write(flash)) return 0;
+    return param.sec_size * param.num_sec == param.flash_size * 0x1000 ? param.sec_size : 0;
+}
+
+// erase marked sectors one range at a time;
+// returns false if the pilot doesn't know how
+bool erase_sectors(session& session, const std::vector<bool>& erase, size_t sec_size)
+{
+    for (size_t n = 0, first = 0; n < erase.size(); first = n)
+    {
+        if (!erase[n]) { ++n; continue; }
+        while (n < erase.size() && erase[n]) ++n;
+
+        erase_data range;
+        range.address = first * sec_size;
+        range.num_sec = n - first;
+
+        doing(first, "-", n - 1);
+        send_packet(session, TC_SYSTEM_ERASESECTORS, { addressof(range), sizeof(range) });
+        auto [is_ack, payload, tag] = recv_packet(session, TC_SYSTEM_ERASESECTORS, session.params.erase_time);
+
+        if (!is_ack)
+        {
+            if (first == static_cast<size_t>(std::find(erase.begin(), erase.end(), true) - erase.begin())) return false;
+            throw std::runtime_error{"Error erasing sectors at offset " + to_hex(range.address)};
+        }
+    }
+    return true;
+}
+
+void read_flash(session& session, payload& data, unsigned window)
+{
+    struct chunk
+    {
+        byte tag;
+        read_data read;
+        size_t size; // size of the escaped packet
+    };
+    std::deque<chunk> sent;
+
+    // bytes of unacknowledged packets that may still be in the pilot's RX ring
+    size_t queued = 0;
+
+    std::span<const byte> packet;
+    byte next_tag = 0;
+    read_data read;
+
+    for (size_t offset = 0, done = 0, size = data.size(); done < size; )
+    {
+        if (offset < size && packet.empty())
+        {
+            read.type = TC_SYSREAD_PHYSICAL;
+            read.data_size = std::min(read_size, size - offset);
+            read.address = session.base + offset;
+            packet = encode_packet(session.packet, TC_SYSTEM_READ, { addressof(read), sizeof(read) }, next_tag);
+        }
+
+        if (packet.size() && sent.size() < window && (sent.empty() || queued + packet.size() <= pilot_rx_size))
+        {
+            send_bytes(session.port, packet, session.params, false);
+            queued += packet.size();
+
+            sent.push_back({ next_tag++, read, packet.size() });
+            offset += read.data_size;
+            packet = { };
+        }
+        else
+        {
+            auto [is_ack, payload, tag] = recv_packet(session, TC_SYSTEM_READ);
+
+            auto& front = sent.front();
+            auto offset = front.read.address - session.base;
+            if (tag != front.tag) throw std::runtime_error{"Lost read request at offset " + to_hex(offset)};
+            if (!is_ack) throw std::runtime_error{"Error reading data chunk at offset " + to_hex(offset)};
+
+            read_reply reply;
+            auto head_size = sizeof(reply) - sizeof(reply.data);
+            if (payload.size() != head_size + front.read.data_size) throw std::runtime_error{"Invalid read data"};
+
+            std::copy(payload.begin(), payload.end(), addressof(reply));
+            if (reply.address != front.read.address || reply.data_size != front.read.data_size) throw std::runtime_error{"Invalid read data"};
+
+            std::copy(reply.data, reply.data + reply.data_size, data.begin() + offset);
+            done += reply.data_size;
+
+            progress(done * 100 / size);
+
+            queued -= front.size;
+            sent.pop_front();
+        }
+    }
+}
+
+// mark chunks that have program data in them
+std::vector<bool> used_chunks(const image& image)
+{
+    std::vector<bool> used((image.size() + write_size - 1) / write_size, false);
+    for (auto& seg : image.segments())
+        for (auto n = seg.address / write_size; n * write_size < seg.end(); ++n) used[n] = true;
+    return used;
+}
+
+// compare program against flash contents and mark chunks that need
+// to be written and sectors that need to be erased first;
+// holes are don't care
+void diff_flash(const image& image, const payload& data, size_t sec_size, const std::vector<bool>& used, std::vector<bool>& dirty, std::vector<bool>& erase)
+{
+    std::fill(dirty.begin(), dirty.end(), false);
+    std::fill(erase.begin(), erase.end(), false);
+    for (auto& seg : image.segments())
+    {
+        auto fl = data.begin() + seg.address;
+        for (size_t n = 0; n < seg.data.size(); ++n)
+            if (seg.data[n] != fl[n])
+            {
+                auto offset = seg.address + n;
+                dirty[offset / write_size] = true;
+
+                // flash can only turn 1's into 0's without erasing
+                if ((seg.data[n] & fl[n]) != seg.data[n]) erase[offset / sec_size] = true;
+            }
+    }
+
+    // erased sectors have to be rewritten
+    for (size_t n = 0; n < dirty.size(); ++n)
+        if (erase[n * write_size / sec_size]) dirty[n] = used[n];
+}
+
+// erased flash reads as 0xff, so blank chunks need not be written
+bool is_blank(std::span<const byte> data)
+{
+    return std::all_of(data.begin(), data.end(), [](byte b){ return b == 0xff; });
+}
+
+// unmark chunks with nothing framed and return number of bytes
+// skipped, including blank pieces frame_chunks left out of the rest
+size_t skip_blank(std::span<const byte> program, const frames& frames, std::vector<bool>& dirty)
+{
+    std::vector<size_t> framed(dirty.size());
+    for (auto& fr : frames.chunks) framed[fr.offset / write_size] += fr.size;
+
+    size_t skipped = 0;
+    for (size_t n = 0; n < dirty.size(); ++n)
+        if (dirty[n])
+        {
+            auto offset = n * write_size, size = std::min(write_size, program.size() - offset);
+            skipped += size - framed[n];
+            if (!framed[n]) dirty[n] = false;
+        }
+    return skipped;
+}
+
+// frame data chunk into buffer, packed if asked and it helps;
+// returns the packet and whether it is packed
+auto make_chunk(std::span<byte> buffer, dword address, std::span<const byte> data, byte tag, bool compress)
 {
     write_data chunk;
     chunk.type = TC_SYSWRITE_PHYSICAL;
-    chunk.data_size = size;
-    chunk.address = 0x00080000 + offset;
-    std::copy(data, data + size, chunk.data);
+    chunk.data_size = data.size();
+    chunk.address = address;
 
-    send_packet(port, TC_SYSTEM_WRITE, addressof(chunk), sizeof(chunk) - sizeof(chunk.data) + size);
-    auto [is_ack, payload] = recv_packet(port, TC_SYSTEM_WRITE);
+    auto head_size = sizeof(chunk) - sizeof(chunk.data);
+    if (compress)
+        if (auto n = rle_pack(data, { chunk.data, data.size() - 1 }))
+            return std::pair{encode_packet(buffer, TC_SYSTEM_WRITEPACKED, { addressof(chunk), head_size + n }, tag), true};
 
-    if (!is_ack) throw std::runtime_error{"Error writing data chunk"};
+    // data goes straight from the program
+    return std::pair{encode_packet(buffer, TC_SYSTEM_WRITE, { { addressof(chunk), head_size }, data }, tag), false};
 }
 
-void run_program(asio::serial_port& port, bool run_in_ram)
+// largest chunk size that lets window packets fit in the pilot's RX ring
+size_t chunk_size(unsigned window)
+{
+    auto size = write_size;
+    auto over = 1 + sizeof(packet_head) + sizeof(write_data) - sizeof(write_data::data) + sizeof(word);
+    while (size > 16 && window * (over + size) > pilot_rx_size) size /= 2;
+    return size;
+}
+
+// frame every used chunk at base (skipping blank ones in flash);
+// runs on a worker thread while the flash is being read and erased
+frames frame_chunks(std::span<const byte> program, const std::vector<bool>& used, dword base, size_t step, bool compress)
+{
+    frames frames;
+    byte tag = 0;
+
+    for (size_t offset = 0; offset < program.size(); offset += step)
+    {
+        auto data = program.subspan(offset, std::min(step, program.size() - offset));
+        if (!used[offset / write_size] || (base == flash_address && is_blank(data))) continue;
+
+        // frame in place at the end of the buffer
+        auto pos = frames.buffer.size();
+        frames.buffer.resize(pos + max_packet_size);
+
+        auto [packet, packed] = make_chunk({ frames.buffer.data() + pos, max_packet_size }, base + offset, data, tag, compress);
+        auto check = fletcher8(packet.data(), packet.size());
+
+        frames.chunks.push_back({ static_cast<dword>(offset), data.size(), pos, packet.size(), tag++, packed, check });
+        frames.buffer.resize(pos + packet.size());
+    }
+
+    frames.data = frames.buffer;
+    return frames;
+}
+
+// send dirty chunks and unmark them as they get acknowledged;
+// on link errors resend everything not yet acknowledged, one at a time
+void send_chunks(session& session, std::span<const byte> program, const frames& frames, std::vector<bool>& dirty, unsigned& window)
+{
+    struct chunk
+    {
+        byte tag;
+        const frame* fr;
+        size_t size; // size of the escaped packet
+        bool packed;
+    };
+    std::deque<chunk> sent;
+
+    // chunks to be sent again
+    std::deque<const frame*> redo;
+    bool packed_ok = session.extended;
+
+    // bytes of unacknowledged packets that may still be in the pilot's RX ring
+    size_t queued = 0;
+
+    std::span<const byte> packet;
+    chunk next{ };
+
+    auto in_flight = [&](byte tag){ return std::any_of(sent.begin(), sent.end(), [&](auto& c){ return c.tag == tag; }); };
+
+    // frames left to send in each dirty chunk
+    std::vector<unsigned> pending(dirty.size());
+    for (auto& fr : frames.chunks)
+        if (dirty[fr.offset / write_size]) ++pending[fr.offset / write_size];
+
+    size_t total = std::count(dirty.begin(), dirty.end(), true) * write_size, acked = 0;
+    unsigned retries = 0;
+
+    for (auto it = frames.chunks.begin(); it != frames.chunks.end() || redo.size() || packet.size() || sent.size(); )
+    try
+    {
+        if (packet.empty() && (redo.size() || it != frames.chunks.end()))
+        {
+            const frame* fr;
+            if (redo.size())
+            {
+                fr = redo.front();
+                redo.pop_front();
+            }
+            else if (dirty[it->offset / write_size]) fr = &*it++;
+            else { ++it; continue; }
+
+            next = { fr->tag, fr, 0, fr->packed && packed_ok };
+            if (fr->packed && !packed_ok)
+                packet = make_chunk(session.packet, session.base + fr->offset, program.subspan(fr->offset, fr->size), fr->tag, false).first;
+            else
+            {
+                packet = frames.data.subspan(fr->pos, fr->length);
+                if (fletcher8(packet.data(), packet.size()) != fr->check)
+                    throw std::runtime_error{"Corrupt frame at offset " + to_hex(fr->offset)};
+            }
+        }
+
+        // NB: tags are assigned when framing, so they may repeat within the window
+        if (packet.size() && sent.size() < window && (sent.empty() || queued + packet.size() <= pilot_rx_size) && !in_flight(next.tag))
+        {
+            send_bytes(session.port, packet, session.params, false);
+            queued += packet.size();
+
+            next.size = packet.size();
+            sent.push_back(next);
+            packet = { };
+        }
+        else
+        {
+            auto& front = sent.front();
+            auto [is_ack, payload, tag] = recv_packet(session, front.packed ? TC_SYSTEM_WRITEPACKED : TC_SYSTEM_WRITE);
+
+            auto offset = front.fr->offset;
+            if (tag != front.tag) throw link_error{"Lost data chunk at offset " + to_hex(offset)};
+            if (is_ack)
+            {
+                if (!--pending[offset / write_size]) dirty[offset / write_size] = false;
+                retries = 0;
+
+                acked += front.fr->size;
+                progress(std::min(acked, total) * 100 / total);
+            }
+            else if (front.packed)
+            {
+                // pilot can't unpack; fall back to plain writes
+                packed_ok = false;
+                redo.push_back(front.fr);
+            }
+            else throw link_error{"Error writing data chunk at offset " + to_hex(offset)};
+
+            queued -= front.size;
+            sent.pop_front();
+        }
+    }
+    catch (const link_error& e)
+    {
+        // the pilot may be dropping packets that arrive while it writes
+        if (window > 1)
+        {
+            message(e.what(), ", falling back to window 1\n");
+            window = 1;
+        }
+        else if (++retries > session.params.retries) throw;
+
+        // let the pilot finish what it has and drop its replies
+        while (session.rx.wait(retry_time)) session.rx.get();
+        session.decoder = packet_decoder{ };
+
+        // and go back to the first unacknowledged chunk
+        if (packet.size()) redo.push_front(next.fr);
+        for (auto ri = sent.rbegin(); ri != sent.rend(); ++ri) redo.push_front(ri->fr);
+
+        sent.clear();
+        queued = 0;
+        packet = { };
+    }
+}
+
+// move the pilot to address in RAM
+void relocate_pilot(session& session, dword address)
+{
+    send_packet(session, TC_SYSTEM_RELOCATE, { addressof(address), sizeof(address) });
+    auto [is_ack, payload, tag] = recv_packet(session, TC_SYSTEM_RELOCATE);
+
+    if (!is_ack) throw std::runtime_error{"Error relocating pilot"};
+}
+
+void start_bios(session& session, bool run_in_ram)
 {
-    sleep_for(100ms);
     byte run_in = run_in_ram ? TC_STARTBIOS_RAM : TC_STARTBIOS_FLASH;
 
-    send_packet(port, TC_SYSTEM_STARTBIOS, addressof(run_in), sizeof(run_in));
+    send_packet(session, TC_SYSTEM_STARTBIOS, { addressof(run_in), sizeof(run_in) });
 }
 
+void verify_flash(session& session, const image& image, unsigned window)
+{
+    payload data(image.size());
+    read_flash(session, data, window);
+
+    // holes are don't care
+    for (auto& seg : image.segments())
+    {
+        auto fl_begin = data.begin() + seg.address;
+        auto [pgm, fl] = std::mismatch(seg.data.begin(), seg.data.end(), fl_begin);
+        if (pgm != seg.data.end()) throw std::runtime_error{
+            "Verify error at address " + to_hex(static_cast<dword>(session.base + seg.address + (pgm - seg.data.begin()))) +
+            ": expected=" + to_hex(*pgm) + " actual=" + to_hex(*fl)
+        };
+    }
 }
 
-void send_program(asio::serial_port& port, const payload& program, const params& params)
+// get the pilot talking at the best baud rate (unless warm), probe the
+// board and settle the link profile
+auto open_session(session& session, link_profile& link, bool warm)
 {
-    unsigned rate;
-    do_("Negotiating baud rate", [&]{ rate = find_baud_rate(port, params); });
-    do_("Switching to ", rate, [&]{ baud_rate(port, rate); });
+    auto& params = session.params;
+
+    // a pilot left running too fast for --slow gets renegotiated
+    unsigned rate = link.baud_rate;
+    if (!warm || (params.slow && rate > max_baud_rate / 4))
+    {
+        do_("Negotiating baud rate", [&]{ rate = find_baud_rate(session, link.baud_rate); });
+        do_("Switching to ", rate, [&]{ baud_rate(session.port, rate); });
+    }
 
     info_probe probe;
-    do_("Probing board info", [&]{ probe = recv_info(port); });
+    do_("Probing board info", [&]{ probe = recv_info(session); });
+
+    do_("Checking pilot extensions", [&]{
+        probe_extensions(session);
+        doing(!session.extended ? "none" : session.pipelined ? "pipelined" : "found");
+    });
+
+    // reuse window & chunk size from last time, if it was the same board
+    if (link.prod_id != probe.id_block.prod_id) link.window = link.chunk_size = 0;
+
+    link.prod_id = probe.id_block.prod_id;
+    link.baud_rate = rate;
+    if (!link.window) link.window = params.window;
+
+    // unless built with PB_PIPELINED_RX, the pilot flushes its RX ring
+    // while replying and doesn't listen while writing flash
+    if (!session.pipelined && link.window > 1)
+    {
+        message("Window ", link.window, " needs pilot.bin built with PB_PIPELINED_RX; using window 1\n");
+        link.window = 1;
+    }
+
+    auto max_chunk = chunk_size(link.window);
+    if (!link.chunk_size || link.chunk_size > max_chunk || write_size % link.chunk_size) link.chunk_size = max_chunk;
+
+    return probe;
+}
+
+}
+
+bool find_pilot(asio::serial_port& port, const params& params, unsigned rate)
+{
+    bool found = false;
+    do_("Looking for running pilot at ", rate, [&]{
+        baud_rate(port, rate);
+        flush(port, que_both);
+
+        session session{port, params};
+        try
+        {
+            send_packet(session, TC_SYSTEM_INFOPROBE);
+            found = try_recv_packet(session, TC_SYSTEM_INFOPROBE, params.probe_time).has_value();
+        }
+        catch (const std::runtime_error&) { } // whatever is running there stalls the port or sends garbage
+
+        doing(found ? "found" : "none");
+    });
+    return found;
+}
+
+frames frame_image(const image& image, const params& params)
+{
+    payload holes;
+    auto& segs = image.segments();
+    auto program = segs.size() == 1 && segs[0].address == 0 ? segs[0].data : std::span<const byte>{holes = image.flat()};
+
+    return frame_chunks(program, used_chunks(image), flash_address, chunk_size(params.window), params.compress);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+namespace
+{
+
+// how far an upload got, so it can be resumed
+struct upload_state
+{
+    bool erased = false;     // flash is ready for the dirty chunks
+    std::vector<bool> dirty; // chunks still to be written
+    ::frames frames;         // unless the pack has them
+};
+
+void send_program(session& session, const pack& pack, link_profile& link, bool warm, upload_state& state)
+{
+    auto& image = pack.image;
+    auto& params = session.params;
+    bool resume = state.erased;
+
+    auto probe = open_session(session, link, warm);
 
     message("CPU   ID: ", to_hex(probe.cpu_id));
     if (auto it = cpu_info.find(probe.cpu_id); it != cpu_info.end())
@@ -330,25 +842,186 @@ void send_program(asio::serial_port& port, const payload& program, const params&
     auto& flash = it->second;
     message("Flash ID: ", to_hex(probe.flash_id), " (", flash.name, ")\n");
 
+    if (pack.flash_id && pack.flash_id != probe.flash_id)
+        throw std::runtime_error{"Program was packed for flash type " + to_hex(pack.flash_id)};
+
     message("div_19200 = ", static_cast<int>(probe.div_19200), '\n');
 
-    do_("Sending flash data", [&]{ send_flash_data(port, flash); });
-    do_("Erasing flash", [&]{ erase_flash(port, program.size()); });
+    if (!image.size()) throw std::runtime_error{"Empty program"};
 
-    do_("Sending program", [&]{
-        sleep_for(100ms);
+    // in RAM, the program must stay clear of the pilot
+    bool in_ram = params.run_in_ram;
+    if (in_ram)
+    {
+        message("RAM size: ", probe.ram_size * 32, "K\n");
 
-        auto delta = write_size;
-        for (size_t offset = 0, size = program.size(); offset < size; offset += delta)
+        auto ram_size = probe.ram_size * 0x8000ul;
+        if (image.size() > ram_size) throw std::runtime_error{"Program doesn't fit in RAM"};
+
+        // if it is in the way, move the pilot to the top of RAM
+        auto& segs = image.segments();
+        if (!resume && std::any_of(segs.begin(), segs.end(), [](auto& seg){ return seg.address < pilot_end && seg.end() > pilot_start; }))
         {
-            if (offset + delta > size) delta = size - offset;
-            send_chunk(port, offset, program.data() + offset, delta);
+            dword address = ram_size - (pilot_end - pilot_start);
+            if (image.size() > address) throw std::runtime_error{"Program doesn't leave room for pilot in RAM"};
 
-            auto pc = offset * 100 / size;
-            message(pc, "%... ", std::string(5 + ((pc < 10) ? 1 : (pc < 100) ? 2 : 3), '\b'));
+            do_("Relocating pilot to ", to_hex(address), [&]{ relocate_pilot(session, address); });
         }
+
+        session.base = 0;
+    }
+    else
+    {
+        do_("Sending flash data", [&]{ send_flash_data(session, flash); });
+        if (params.compress && !session.extended) message("Pilot can't unpack writes, sending them plain\n");
+    }
+
+    // holes read as erased flash, but are not written;
+    // flat images are used in place
+    payload holes;
+    auto& segs = image.segments();
+    auto program = segs.size() == 1 && segs[0].address == 0 ? segs[0].data : std::span<const byte>{holes = image.flat()};
+
+    auto used = used_chunks(image);
+    std::future<frames> framing;
+
+    if (in_ram && !resume)
+    {
+        // packed writes only go to flash, and pack frames are for flash too
+        state.dirty = used;
+        framing = std::async(std::launch::async, frame_chunks, program, std::cref(used), session.base, link.chunk_size, false);
+        state.erased = true;
+    }
+    else if (!resume)
+    {
+        // without uniform sectors (or on page-write parts), treat the program as
+        // one big sector; same if it spills into the 2nd flash, which only
+        // ERASEFLASH knows about
+        auto sec_size = program.size() <= flash.param.flash_size * 0x1000ul ? sector_size(flash) : 0;
+        auto erase_size = sec_size ? sec_size : program.size();
+
+        auto& dirty = state.dirty = used;
+        std::vector<bool> erase((program.size() + erase_size - 1) / erase_size, true);
+
+        // unless already framed, frame data chunks while busy with the flash
+        if (pack.frames.chunks.empty())
+            framing = std::async(std::launch::async, frame_chunks, program, std::cref(used), session.base, link.chunk_size, params.compress && session.extended);
+
+        if (params.diff)
+        {
+            payload data(program.size());
+            do_("Reading flash", [&]{ read_flash(session, data, link.window); });
+
+            do_("Comparing", [&]{
+                diff_flash(image, data, erase_size, used, dirty, erase);
+                doing(std::count(dirty.begin(), dirty.end(), true), " of ", dirty.size(), " chunks changed");
+            });
+        }
+
+        if (std::count(erase.begin(), erase.end(), true)) do_("Erasing flash", [&]{
+            // stock pilot can only erase from the start of the flash
+            if (sec_size && !session.extended) doing("no sector erase in pilot");
+
+            if (!sec_size || !session.extended || !erase_sectors(session, erase, sec_size))
+            {
+                // erase everything through the last marked sector and rewrite it
+                auto end = std::min((erase.rend() - std::find(erase.rbegin(), erase.rend(), true)) * erase_size, program.size());
+                doing("up to ", to_hex(end - 1));
+                erase_flash(session, end - 1);
+
+                for (size_t n = 0; n * write_size < end; ++n) dirty[n] = used[n];
+            }
+        });
+        state.erased = true;
+    }
+
+    do_("Sending program", [&]{
+        if (framing.valid()) state.frames = framing.get();
+        auto& frames = pack.frames.chunks.size() && !in_ram ? pack.frames : state.frames;
+
+        if (resume) doing("resuming");
+
+        // everything still dirty has just been erased
+        else if (auto skipped = in_ram ? 0 : skip_blank(program, frames, state.dirty)) doing(skipped, " blank bytes skipped");
+
+        send_chunks(session, program, frames, state.dirty, link.window);
         message("100%... ");
     });
 
-    if (params.run) do_("Launching program", [&](){ run_program(port, params.run_in_ram); });
+    if (params.verify) do_("Verifying", [&]{ verify_flash(session, image, link.window); });
+
+    // a program in RAM is gone once the pilot runs anything else
+    if (params.run || in_ram) do_("Launching program", [&](){ start_bios(session, in_ram); });
+    link.pilot = !params.run && !in_ram;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void send_program(asio::serial_port& port, const pack& pack, const params& params, link_profile& link, bool warm)
+{
+    session session{port, params};
+    upload_state state;
+    send_program(session, pack, link, warm, state);
+}
+
+void send_program(asio::serial_port& port, const std::string& name, const pack& pack, const params& params, link_profile& link, bool warm)
+{
+    upload_state state;
+    for (unsigned n = 0;; ++n)
+    try
+    {
+        session session{port, params};
+        send_program(session, pack, link, warm, state);
+        return;
+    }
+    catch (const asio::system_error& e)
+    {
+        // port dropped once the flash was erased; carry on where it stopped
+        if (!state.erased || n >= params.retries) throw;
+        message(e.what(), '\n');
+
+        reopen_serial(port, name, params.reconnect_time);
+        if (!find_pilot(port, params, link.baud_rate)) throw;
+        warm = true;
+    }
+}
+
+info_probe probe_target(asio::serial_port& port, const params& params, link_profile& link, bool warm)
+{
+    session session{port, params};
+    auto probe = open_session(session, link, warm);
+    link.pilot = true;
+
+    return probe;
+}
+
+void verify_program(asio::serial_port& port, const image& image, const params& params, link_profile& link, bool warm)
+{
+    session session{port, params};
+    open_session(session, link, warm);
+
+    do_("Verifying", [&]{ verify_flash(session, image, link.window); });
+    link.pilot = true;
+}
+
+payload read_program(asio::serial_port& port, size_t size, const params& params, link_profile& link, bool warm)
+{
+    session session{port, params};
+    open_session(session, link, warm);
+
+    payload data(size);
+    do_("Reading flash", [&]{ read_flash(session, data, link.window); });
+    link.pilot = true;
+
+    return data;
+}
+
+void run_program(asio::serial_port& port, const params& params, link_profile& link, bool warm)
+{
+    session session{port, params};
+    open_session(session, link, warm);
+
+    do_("Launching program", [&](){ start_bios(session, params.run_in_ram); });
+    link.pilot = false;
 }
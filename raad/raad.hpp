@@ -8,25 +8,78 @@
 #ifndef RAAD_HPP
 #define RAAD_HPP
 
+#include "image.hpp"
+#include "link.hpp"
+#include "pack.hpp"
+#include "rabbit.hpp"
 #include "types.hpp"
+
 #include <asio.hpp>
+#include <chrono>
+#include <stdexcept>
+
+using msec = std::chrono::milliseconds;
 
 struct params
 {
+    bool compress = false;
+    bool diff = false;
     bool run = false;
     bool run_in_ram = false;
     bool slow = false;
     bool use_cts = false;
     bool use_rts = false;
+    bool verify = false;
+    unsigned window = 1;
+    unsigned retries = 3;       // resends per data chunk and reconnects per upload
+    unsigned boot_tries = 3;    // bootstrap attempts
+
+    msec reset_time = 250ms;    // how long to hold target in reset
+    msec boot_time = 350ms;     // how long target takes to come out of reset
+    msec status_time = 100ms;   // worst-case /STATUS pin response time
+    msec reply_time = 1000ms;   // worst-case pilot response time
+    msec write_time = 1000ms;   // worst-case wait for the port to take data
+    msec erase_time = 30000ms;  // worst-case flash erase time
+    msec probe_time = 100ms;    // how long to wait for a pilot left running
+    msec boot_backoff = 500ms;  // extra wait before each bootstrap retry
+    msec reconnect_time = 5000ms; // how long to wait for a dropped port to come back
+};
+
+// garbled, lost or missing reply; worth another try
+struct link_error : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
 };
 
 void reset_target(asio::serial_port&, const params&);
 void detect_target(asio::serial_port&, const params&);
 
 void send_coldload(asio::serial_port&, const payload&, const params&);
-void send_pilot(asio::serial_port&, const payload&);
+void send_pilot(asio::serial_port&, const payload&, const params&);
+
+// all of the above; on failure reset and try again up to boot_tries times
+void bootstrap(asio::serial_port&, const payload& coldload, const payload& pilot, const params&);
+
+// check if pilot from the previous run is still there
+bool find_pilot(asio::serial_port&, const params&, unsigned rate);
+
+// frame program chunks for a pack file
+frames frame_image(const image&, const params&);
+
+// link is the profile to try first; updated with what was used
+// warm means the pilot is already running at link.baud_rate
+void send_program(asio::serial_port&, const pack&, const params&, link_profile&, bool warm = false);
+
+// same, but if the port drops once the flash is erased, reopen it by name,
+// find the pilot still running there and resume from the last acknowledged chunk
+void send_program(asio::serial_port&, const std::string& name, const pack&, const params&, link_profile&, bool warm = false);
+
+// get the pilot talking and return what it says about the board
+info_probe probe_target(asio::serial_port&, const params&, link_profile&, bool warm = false);
 
-void send_program(asio::serial_port&, const payload&, const params&);
+void verify_program(asio::serial_port&, const image&, const params&, link_profile&, bool warm = false);
+payload read_program(asio::serial_port&, size_t size, const params&, link_profile&, bool warm = false);
+void run_program(asio::serial_port&, const params&, link_profile&, bool warm = false);
 
 ////////////////////////////////////////////////////////////////////////////////
 #endif
@@ -0,0 +1,155 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2023 Dimitry Ishenko
+// Contact: dimitry (dot) ishenko (at) (gee) mail (dot) com
+//
+// Distributed under the GNU GPL license. See the LICENSE.md file for details.
+
+////////////////////////////////////////////////////////////////////////////////
+#include "escape.hpp"
+#include "packet.hpp"
+#include "types.hpp"
+
+#include <cstdlib> // EXIT_FAILURE, EXIT_SUCCESS
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+namespace
+{
+
+int failed = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failed;
+    }
+}
+
+payload from_hex(const std::string& hex)
+{
+    payload data;
+    std::istringstream is{hex};
+    for (unsigned b; is >> std::hex >> b; ) data.push_back(b);
+    return data;
+}
+
+// frames captured in bootstrapping.md
+const char* captured[] =
+{
+    "7e 02 00 00 06 04 00 26 0c 00 08 07 00 b5 4d",
+    "7e 02 00 00 86 00 00 9f 88 78 b0",
+    "7e 02 00 00 04 00 00 18 06 5a 24",
+    "7e 02 00 00 0a 08 00 3a 14 00 10 80 00 80 00 01 00 75 74",
+    "7e 02 00 00 8a 00 00 ab 8c a8 c4",
+    "7e 02 00 00 09 04 00 2f 0f 50 cf 08 00 b0 75",
+    "7e 02 00 00 89 00 00 a8 8b 9c bf",
+    "7e 02 00 00 83 00 00 96 85 54 a1",
+    "7e 02 00 00 05 01 00 1d 08 02 9e 2f",
+};
+
+// one byte at a time, as the pilot does it
+payload escape_ref(std::span<const byte> data)
+{
+    payload out;
+    for (auto b : data)
+        if (b == TC_FRAMING_START || b == TC_FRAMING_ESC) { out.push_back(TC_FRAMING_ESC); out.push_back(b & ~0x20); }
+        else out.push_back(b);
+    return out;
+}
+
+payload escaped(std::span<const byte> data)
+{
+    payload out(escaped_size(data));
+    auto end = escape(data, out.data());
+    check(end == out.data() + out.size(), "escape() writes escaped_size() bytes");
+    return out;
+}
+
+// unescape data in two pieces split at pos
+payload unescaped(std::span<const byte> data, size_t pos)
+{
+    payload out(data.size());
+    bool esc = false;
+
+    auto [n1, end1] = unescape(data.first(pos), out.data(), esc);
+    auto [n2, end2] = unescape(data.subspan(pos), end1, esc);
+    check(n1 == pos && n2 == data.size() - pos && !esc, "unescape() uses all bytes");
+
+    out.resize(end2 - out.data());
+    return out;
+}
+
+void test_captured()
+{
+    for (auto hex : captured)
+    {
+        auto frame = from_hex(hex);
+        std::span<const byte> body{frame.begin() + 1, frame.end()};
+
+        for (size_t pos = 0; pos <= body.size(); ++pos)
+        {
+            auto raw = unescaped(body, pos);
+            check(escaped(raw) == payload(body.begin(), body.end()), std::string{"round trip of "} + hex);
+        }
+
+        // and the same frame from the packet codec
+        auto data = body.subspan(sizeof(packet_head), body.size() - sizeof(packet_head) - sizeof(word));
+        packet_buffer buffer;
+        auto packet = encode_packet(buffer, body[3], data);
+        check(payload(packet.begin(), packet.end()) == frame, std::string{"encode_packet() of "} + hex);
+
+        packet_decoder decoder;
+        auto [used, done] = decoder.put(frame);
+        check(used == frame.size() && done && decoder.head().subtype == body[3], std::string{"packet_decoder of "} + hex);
+    }
+}
+
+// 0x7e and 0x7d on either side of the 16-byte blocks escape() works in
+void test_edges()
+{
+    for (byte special : { TC_FRAMING_START, TC_FRAMING_ESC })
+        for (size_t at : { 0, 1, 14, 15, 16, 17, 30, 31, 32, 33, 47, 48, 63 })
+        {
+            payload raw(64);
+            for (size_t n = 0; n < raw.size(); ++n) raw[n] = 0x20 + n; // no specials
+            raw[at] = special;
+            if (at + 1 < raw.size()) raw[at + 1] = special ^ 0x03; // the other one
+
+            auto what = "special at " + std::to_string(at);
+
+            auto esc = escaped(raw);
+            check(esc == escape_ref(raw), "escape() with " + what);
+            check(clean_run(raw) == at, "clean_run() with " + what);
+
+            for (size_t pos = 0; pos <= esc.size(); ++pos)
+                check(unescaped(esc, pos) == raw, "unescape() with " + what + " split at " + std::to_string(pos));
+        }
+}
+
+void test_empty()
+{
+    byte out[1];
+    bool esc = false;
+
+    check(escaped_size({ }) == 0, "escaped_size() of nothing");
+    check(escape({ }, out) == out, "escape() of nothing");
+    check(unescape({ }, out, esc).first == 0 && !esc, "unescape() of nothing");
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int main()
+{
+    test_captured();
+    test_edges();
+    test_empty();
+
+    if (failed) std::cerr << failed << " check(s) failed" << std::endl;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}